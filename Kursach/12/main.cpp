@@ -1,19 +1,182 @@
 #include <iostream>
 #include <fstream>
-#include <sstream>
 #include <string>
 #include <set>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
 #include <exception>
 #include <optional>
+#include <memory>
+#include <algorithm>
+#include <tuple>
+#include <vector>
+#include <queue>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <limits>
+#include <iterator>
+#include <numeric>
+#include <cstring>
+#include <cerrno>
+#include <string_view>
+#include <cstdint>
+#include <new>
+#include <cstdio>
+#include <chrono>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
 
+// Время сообщений хранится как число миллисекунд от 1970-01-01 00:00:00.000 (UTC)
 
+// Количество дней от 1970-01-01 до заданной даты григорианского календаря
+constexpr std::int64_t daysFromCivil(int year, int month, int day) {
+    year -= month <= 2;
+    const std::int64_t era = (year >= 0 ? year : year - 399) / 400;
+    const std::int64_t yearOfEra = year - era * 400;
+    const std::int64_t dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    const std::int64_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + dayOfEra - 719468;
+}
+
+// Обратное преобразование: дата по числу дней от 1970-01-01
+constexpr void civilFromDays(std::int64_t days, int& year, int& month, int& day) {
+    days += 719468;
+    const std::int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    const std::int64_t dayOfEra = days - era * 146097;
+    const std::int64_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    const std::int64_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    const std::int64_t mp = (5 * dayOfYear + 2) / 153;
+    day = static_cast<int>(dayOfYear - (153 * mp + 2) / 5 + 1);
+    month = static_cast<int>(mp < 10 ? mp + 3 : mp - 9);
+    year = static_cast<int>(yearOfEra + era * 400 + (month <= 2));
+}
+
+constexpr bool isLeapYear(int year) {
+    return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+// Читает ровно digits десятичных цифр, начиная с p
+inline bool parseFixedNumber(const char* p, int digits, int& value) {
+    value = 0;
+    for (int i = 0; i < digits; ++i) {
+        const unsigned digit = static_cast<unsigned char>(p[i]) - '0';
+        if (digit > 9) return false;
+        value = value * 10 + static_cast<int>(digit);
+    }
+    return true;
+}
+
+// Разбирает дату "YYYY-MM-DD" и время "HH:MM:SS.mmm" (в журнале после времени
+// может стоять двоеточие-разделитель). Формат фиксированный, память не выделяется.
+bool parseTimestamp(std::string_view date, std::string_view time, std::int64_t& result) {
+    if (date.size() != 10 || (time.size() != 12 && !(time.size() == 13 && time[12] == ':'))) return false;
+    if (date[4] != '-' || date[7] != '-' || time[2] != ':' || time[5] != ':' || time[8] != '.') return false;
+
+    int year, month, day, hour, minute, second, millisecond;
+
+    // Разбираем дату
+    if (!parseFixedNumber(date.data(), 4, year) || !parseFixedNumber(date.data() + 5, 2, month) ||
+        !parseFixedNumber(date.data() + 8, 2, day)) return false;
+
+    static const int daysInMonth[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    if (month < 1 || month > 12 || day < 1) return false;
+    if (day > daysInMonth[month - 1] + (month == 2 && isLeapYear(year))) return false;
+
+    // Разбираем время
+    if (!parseFixedNumber(time.data(), 2, hour) || !parseFixedNumber(time.data() + 3, 2, minute) ||
+        !parseFixedNumber(time.data() + 6, 2, second) || !parseFixedNumber(time.data() + 9, 3, millisecond)) return false;
+    if (hour > 23 || minute > 59 || second > 59) return false;
+
+    result = ((daysFromCivil(year, month, day) * 24 + hour) * 60 + minute) * 60000 + second * 1000 + millisecond;
+    return true;
+}
+
+// То же для строки "YYYY-MM-DD HH:MM:SS.mmm"
+bool parseTimestamp(std::string_view dateTime, std::int64_t& result) {
+    if (dateTime.size() < 11 || dateTime[10] != ' ') return false;
+    return parseTimestamp(dateTime.substr(0, 10), dateTime.substr(11), result);
+}
+
+inline char* formatDigits(char* out, int value, int digits) {
+    for (int i = digits - 1; i >= 0; --i) {
+        out[i] = static_cast<char>('0' + value % 10);
+        value /= 10;
+    }
+    return out + digits;
+}
+
+// Пишет время в buffer (не меньше 32 байт) и возвращает длину записи
+std::size_t formatTimestamp(std::int64_t timestamp, char* buffer) {
+    std::int64_t days = timestamp / 86400000;
+    std::int64_t msOfDay = timestamp % 86400000;
+    if (msOfDay < 0) {
+        msOfDay += 86400000;
+        --days;
+    }
+
+    int year, month, day;
+    civilFromDays(days, year, month, day);
+    const int hour = static_cast<int>(msOfDay / 3600000);
+    const int minute = static_cast<int>(msOfDay / 60000 % 60);
+    const int second = static_cast<int>(msOfDay / 1000 % 60);
+    const int millisecond = static_cast<int>(msOfDay % 1000);
+
+    if (year < 0 || year > 9999) {
+        int size = std::snprintf(buffer, 32, "%04d-%02d-%02d %02d:%02d:%02d.%03d", year, month, day,
+                                 hour, minute, second, millisecond);
+        return static_cast<std::size_t>(std::min(size, 31));
+    }
+
+    // Обычный случай без snprintf: он заметен при выводе миллионов строк
+    char* out = formatDigits(buffer, year, 4);
+    *out++ = '-';
+    out = formatDigits(out, month, 2);
+    *out++ = '-';
+    out = formatDigits(out, day, 2);
+    *out++ = ' ';
+    out = formatDigits(out, hour, 2);
+    *out++ = ':';
+    out = formatDigits(out, minute, 2);
+    *out++ = ':';
+    out = formatDigits(out, second, 2);
+    *out++ = '.';
+    out = formatDigits(out, millisecond, 3);
+    return static_cast<std::size_t>(out - buffer);
+}
+
+std::string formatTimestamp(std::int64_t timestamp) {
+    char buffer[32];
+    return std::string(buffer, formatTimestamp(timestamp, buffer));
+}
+
+class ResultSink;
+
+// Поля сообщения указывают в чужую память: сообщения базы - в арену своего
+// сегмента, остальные - в память того, кто их создал.
 struct Message {
-    std::string username;
-    std::string time;
-    std::string content;
+    std::string_view username;
+    std::int64_t time; // миллисекунды от начала эпохи
+    std::string_view content;
 
-    Message(const std::string& uname, const std::string& tm, const std::string& msg)
-        : username(uname), time(tm), content(msg) {}
+    Message(std::string_view uname, std::int64_t tm, std::string_view msg) : username(uname), time(tm), content(msg) {}
+    Message(const Message&) = default;
 
     Message& operator=(const Message& other) {
         if (this != &other) { // Защита от самоприсваивания
@@ -32,152 +195,4967 @@ struct Message {
         return username == other.username && time == other.time && content == other.content;
     }
 
-    void print() const {
-        std::cout << username << " " << time << ": " << content << std::endl;
+    // Строка вида "имя время: текст" в буфер вывода
+    void print(ResultSink& sink) const;
+};
+
+// Буферизованный вывод строк результата в файловый дескриптор. Строки копятся
+// в буфере и записываются одним системным вызовом, когда буфер заполнен,
+// при flush() и при разрушении. Длинный текст не копируется в буфер, а
+// записывается вместе с ним одним writev.
+class ResultSink {
+public:
+    // Вывод в стандартный поток вывода
+    explicit ResultSink(std::size_t bufferSize = 1 << 20) : fd(STDOUT_FILENO), bufferSize(bufferSize) {
+        buffer.reserve(bufferSize);
+    }
+
+    // Вывод в файл (создаётся заново)
+    explicit ResultSink(const std::string& filename, std::size_t bufferSize = 1 << 20)
+        : filename(filename), bufferSize(bufferSize) {
+        fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Could not create file: " + filename);
+        }
+        buffer.reserve(bufferSize);
+    }
+
+    ~ResultSink() {
+        try {
+            flush();
+        } catch (const std::exception& ex) {
+            std::cerr << ex.what() << std::endl;
+        }
+        if (fd != STDOUT_FILENO) {
+            ::close(fd);
+        }
+    }
+
+    ResultSink(const ResultSink&) = delete;
+    ResultSink& operator=(const ResultSink&) = delete;
+
+    // Строка вида "имя время: текст"
+    void write(std::string_view username, std::int64_t time, std::string_view content) {
+        char stamp[32];
+        buffer.append(username).append(1, ' ').append(stamp, formatTimestamp(time, stamp)).append(": ");
+        if (content.size() > bufferSize / 4) {
+            writeAll({buffer, content, "\n"});
+            buffer.clear();
+            return;
+        }
+
+        buffer.append(content).append(1, '\n');
+        if (buffer.size() >= bufferSize) {
+            flush();
+        }
+    }
+
+    void write(const Message& message) {
+        write(message.username, message.time, message.content);
+    }
+
+    // Произвольный текст, например заголовок
+    void writeText(std::string_view text) {
+        buffer.append(text);
+        if (buffer.size() >= bufferSize) {
+            flush();
+        }
+    }
+
+    void flush() {
+        if (!buffer.empty()) {
+            writeAll({buffer});
+            buffer.clear();
+        }
+    }
+
+private:
+    // Записывает части подряд, продолжая после неполной записи
+    void writeAll(std::initializer_list<std::string_view> parts) {
+        if (fd == STDOUT_FILENO) {
+            std::cout.flush(); // всё, что уже выведено через cout, должно идти раньше
+        }
+
+        iovec vectors[3];
+        int count = 0;
+        for (std::string_view part : parts) {
+            if (!part.empty()) {
+                vectors[count++] = {const_cast<char*>(part.data()), part.size()};
+            }
+        }
+
+        iovec* next = vectors;
+        while (count > 0) {
+            ssize_t written = ::writev(fd, next, count);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error("Could not write " + (filename.empty() ? std::string("output") : filename));
+            }
+            while (count > 0 && static_cast<std::size_t>(written) >= next->iov_len) {
+                written -= static_cast<ssize_t>(next->iov_len);
+                ++next;
+                --count;
+            }
+            if (count > 0) {
+                next->iov_base = static_cast<char*>(next->iov_base) + written;
+                next->iov_len -= static_cast<std::size_t>(written);
+            }
+        }
+    }
+
+    std::string filename;
+    int fd = -1;
+    std::size_t bufferSize;
+    std::string buffer;
+};
+
+inline void Message::print(ResultSink& sink) const {
+    sink.write(username, time, content);
+}
+
+// Ссылка на сообщение базы: копия полей сообщения, имя и текст которой
+// указывают в память сегмента. Действительна, пока жив сегмент, из которого
+// она получена (в том числе в ранее полученных DatabaseView). Сообщения
+// запечатанного сегмента не хранятся отдельными объектами, поэтому ссылка
+// держит поля сама, а если текст сжат - ещё и распакованный блок с ним.
+// Пустая ссылка означает, что сообщение не найдено.
+class MessagePtr {
+public:
+    MessagePtr() = default;
+    MessagePtr(std::nullptr_t) {}
+    MessagePtr(const Message* message) : found(message != nullptr) {
+        if (message) {
+            fields = *message;
+        }
+    }
+    explicit MessagePtr(const Message& message, std::shared_ptr<const void> block = nullptr)
+        : found(true), fields(message), block(std::move(block)) {}
+
+    const Message& operator*() const {
+        return fields;
+    }
+
+    const Message* operator->() const {
+        return &fields;
+    }
+
+    explicit operator bool() const {
+        return found;
+    }
+
+    bool operator==(std::nullptr_t) const {
+        return !found;
     }
 
+    bool operator!=(std::nullptr_t) const {
+        return found;
+    }
+
+private:
+    bool found = false;
+    Message fields{std::string_view(), 0, std::string_view()};
+    std::shared_ptr<const void> block;
 };
 
-class MessageDatabase {
+// Память сообщений сегмента. Объекты Message, имена и тексты размещаются
+// подряд в крупных блоках и не перемещаются, поэтому ссылки на сообщения
+// не меняются. Каждое имя пользователя хранится один раз. Память удалённых
+// сообщений освобождается только вместе с сегментом.
+class MessageArena {
 public:
-    void addMessage(const std::shared_ptr<Message>& msgPtr) {
-        messages.insert(msgPtr);
+    MessageArena() = default;
+    MessageArena(const MessageArena&) = delete;
+    MessageArena& operator=(const MessageArena&) = delete;
+
+    // Копирует сообщение в арену. Если задан owner, текст не копируется:
+    // он остаётся в памяти owner, и арена продлевает её жизнь.
+    const Message* create(const Message& message, const std::shared_ptr<const void>& owner = nullptr) {
+        std::string_view content = message.content;
+        if (!owner) {
+            content = copy(content);
+            copiedContent = true;
+        } else if (owners.empty() || owners.back() != owner) {
+            owners.push_back(owner);
+        }
+        char* place = allocate(sizeof(Message), alignof(Message));
+        return new (place) Message(intern(message.username), message.time, content);
     }
 
-    void removeMessage(const std::shared_ptr<Message>& msgPtr) {
-        auto it = std::find_if(messages.begin(), messages.end(), [&](const std::shared_ptr<Message>& m) {
-            return *m == *msgPtr;
-        });
+    // Владелец, в памяти которого лежат тексты всех сообщений арены, или
+    // nullptr, если таких нет или тексты разбросаны по нескольким владельцам
+    std::shared_ptr<const void> contentOwner() const {
+        return !copiedContent && owners.size() == 1 ? owners.front() : nullptr;
+    }
 
-        if (it != messages.end()) {
-            messages.erase(it);
-        } else {
-            std::cerr << "Message not found for removal.\n";
+    // Имя пользователя в арене (каждое хранится один раз)
+    std::string_view intern(std::string_view name) {
+        auto it = names.find(name);
+        if (it != names.end()) {
+            return *it;
         }
+        std::string_view stored = copy(name);
+        names.insert(stored);
+        return stored;
     }
 
-    void removeAllMessagesFromUser(const std::string& username) {
-        auto it = messages.begin();
-        while (it != messages.end()) {
-            if ((*it)->username == username) {
-                it = messages.erase(it);
+private:
+    static constexpr std::size_t blockSize = 1 << 16;
+
+    char* allocate(std::size_t size, std::size_t align) {
+        std::size_t padding = (align - reinterpret_cast<std::uintptr_t>(current) % align) % align;
+        if (padding + size > left) {
+            // Длинный текст получает отдельный блок
+            std::size_t capacity = std::max(blockSize, size);
+            blocks.emplace_back(new char[capacity]);
+            current = blocks.back().get();
+            left = capacity;
+            padding = 0; // new[] выравнивает блок для любого типа
+        }
+
+        char* result = current + padding;
+        current += padding + size;
+        left -= padding + size;
+        return result;
+    }
+
+    std::string_view copy(std::string_view text) {
+        if (text.empty()) {
+            return {};
+        }
+        char* place = allocate(text.size(), 1);
+        std::memcpy(place, text.data(), text.size());
+        return {place, text.size()};
+    }
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char* current = nullptr;
+    std::size_t left = 0;
+    std::unordered_set<std::string_view> names;
+    std::vector<std::shared_ptr<const void>> owners;
+    bool copiedContent = false;
+};
+
+// Ключ точного поиска сообщения
+struct MessageKey {
+    std::string_view username;
+    std::int64_t time;
+    std::string_view content;
+};
+
+// 64-битный FNV-1a. В отличие от std::hash, результат не зависит от
+// стандартной библиотеки, поэтому такие хэши можно хранить в снимке.
+inline std::uint64_t fnv1a64(std::string_view data, std::uint64_t hash = 0xcbf29ce484222325ULL) {
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// 64-битный хэш ключа: имя, время и текст
+inline std::uint64_t messageKeyHash(std::string_view username, std::int64_t time, std::string_view content) {
+    std::uint64_t hash = fnv1a64(username);
+    hash ^= static_cast<std::uint64_t>(time) + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+    return fnv1a64(content, hash);
+}
+
+inline std::uint64_t messageKeyHash(const Message& message) {
+    return messageKeyHash(message.username, message.time, message.content);
+}
+
+// Порядок по времени сообщения (указателя на него или MessagePtr). Сравнение
+// с числом позволяет искать границы диапазона без создания временного сообщения.
+struct MessageTimeLess {
+    using is_transparent = void;
+
+    template<class A, class B>
+    bool operator()(const A& a, const B& b) const {
+        return timeOf(a) < timeOf(b);
+    }
+
+private:
+    static std::int64_t timeOf(std::int64_t time) {
+        return time;
+    }
+
+    template<class Ptr>
+    static std::int64_t timeOf(const Ptr& message) {
+        return message->time;
+    }
+};
+
+// Таблица имён пользователей: имена по алфавиту подряд в одном буфере.
+// Номер пользователя - место его имени в таблице, поиск номера по имени -
+// двоичный поиск.
+class UserTable {
+public:
+    UserTable() = default;
+
+    // Таблица из имён (повторы отбрасываются)
+    explicit UserTable(std::vector<std::string_view> names) {
+        if (!std::is_sorted(names.begin(), names.end())) {
+            std::sort(names.begin(), names.end());
+        }
+        names.erase(std::unique(names.begin(), names.end()), names.end());
+        nameEnds.reserve(names.size());
+        for (std::string_view name : names) {
+            nameBytes.append(name);
+            nameEnds.push_back(nameBytes.size());
+        }
+    }
+
+    std::optional<std::uint32_t> find(std::string_view name) const {
+        std::size_t low = 0;
+        std::size_t high = size();
+        while (low < high) {
+            const std::size_t middle = low + (high - low) / 2;
+            if (this->name(static_cast<std::uint32_t>(middle)) < name) {
+                low = middle + 1;
             } else {
-                ++it;
+                high = middle;
             }
         }
+        if (low == size() || this->name(static_cast<std::uint32_t>(low)) != name) {
+            return std::nullopt;
+        }
+        return static_cast<std::uint32_t>(low);
     }
 
-    std::optional<std::shared_ptr<Message>> findMessage(const std::string& username, const std::string& time, const std::string& content) const {
-        for (const auto& msg : messages) {
-            if (msg->username == username && msg->time == time && msg->content == content) {
-                return msg;
-            }
+    std::string_view name(std::uint32_t id) const {
+        const std::uint64_t begin = id == 0 ? 0 : nameEnds[id - 1];
+        return std::string_view(nameBytes).substr(begin, nameEnds[id] - begin);
+    }
+
+    std::size_t size() const {
+        return nameEnds.size();
+    }
+
+private:
+    std::vector<std::uint64_t> nameEnds; // конец каждого имени в nameBytes
+    std::string nameBytes;
+};
+
+// Простое сжатие LZ77 в духе LZ4 для блоков текста. Поток состоит из
+// последовательностей: байт-метка (старшие 4 бита - длина литералов,
+// младшие - длина совпадения минус 4; значение 15 продолжается байтами,
+// пока они равны 255), литералы, смещение совпадения (2 байта, little-endian)
+// и продолжение длины совпадения. Последняя последовательность - только литералы.
+constexpr std::size_t lzMinMatch = 4;
+constexpr std::size_t lzMaxOffset = 65535;
+constexpr int lzHashBits = 14;
+
+inline void lzAppendLength(std::string& out, std::size_t length) {
+    for (; length >= 255; length -= 255) {
+        out.push_back(static_cast<char>(255));
+    }
+    out.push_back(static_cast<char>(length));
+}
+
+inline void lzAppendSequence(std::string& out, std::string_view literals, std::size_t offset, std::size_t matchLength) {
+    const std::size_t matchCode = matchLength == 0 ? 0 : matchLength - lzMinMatch;
+    out.push_back(static_cast<char>((std::min<std::size_t>(literals.size(), 15) << 4) | std::min<std::size_t>(matchCode, 15)));
+    if (literals.size() >= 15) {
+        lzAppendLength(out, literals.size() - 15);
+    }
+    out.append(literals);
+    if (matchLength == 0) {
+        return;
+    }
+    out.push_back(static_cast<char>(offset & 0xff));
+    out.push_back(static_cast<char>(offset >> 8));
+    if (matchCode >= 15) {
+        lzAppendLength(out, matchCode - 15);
+    }
+}
+
+inline std::string lzCompress(std::string_view input) {
+    std::string out;
+    out.reserve(input.size() / 2 + 16);
+    // Последняя позиция (плюс 1) каждой четвёрки байт по её хэшу
+    std::vector<std::uint32_t> table(std::size_t(1) << lzHashBits, 0);
+    std::size_t anchor = 0;
+    std::size_t pos = 0;
+    while (pos + lzMinMatch <= input.size()) {
+        std::uint32_t sequence;
+        std::memcpy(&sequence, input.data() + pos, sizeof(sequence));
+        std::uint32_t& slot = table[(sequence * 2654435761u) >> (32 - lzHashBits)];
+        const std::size_t candidate = slot;
+        slot = static_cast<std::uint32_t>(pos + 1);
+
+        if (candidate == 0 || pos - (candidate - 1) > lzMaxOffset ||
+            std::memcmp(input.data() + candidate - 1, input.data() + pos, lzMinMatch) != 0) {
+            ++pos;
+            continue;
+        }
+
+        const std::size_t match = candidate - 1;
+        std::size_t length = lzMinMatch;
+        while (pos + length < input.size() && input[match + length] == input[pos + length]) {
+            ++length;
         }
-        return std::nullopt;
+        lzAppendSequence(out, input.substr(anchor, pos - anchor), pos - match, length);
+        pos += length;
+        anchor = pos;
     }
+    lzAppendSequence(out, input.substr(anchor), 0, 0);
+    return out;
+}
 
-    void printAllMessagesFromUser(const std::string& username) const {
-        for (const auto& message : messages) {
-            if (message->username == username) {
-                message->print();
+// Распаковывает ровно size байт в out. Повреждённый поток - std::runtime_error.
+inline void lzDecompress(std::string_view input, char* out, std::size_t size) {
+    auto fail = []() {
+        throw std::runtime_error("Corrupted compressed block.");
+    };
+    std::size_t in = 0;
+    std::size_t written = 0;
+    auto readLength = [&](std::size_t length) {
+        if (length == 15) {
+            std::uint8_t byte;
+            do {
+                if (in >= input.size()) fail();
+                byte = static_cast<std::uint8_t>(input[in++]);
+                length += byte;
+            } while (byte == 255);
+        }
+        return length;
+    };
+
+    while (true) {
+        if (in >= input.size()) fail();
+        const std::uint8_t token = static_cast<std::uint8_t>(input[in++]);
+
+        const std::size_t literals = readLength(token >> 4);
+        if (literals > input.size() - in || literals > size - written) fail();
+        std::memcpy(out + written, input.data() + in, literals);
+        in += literals;
+        written += literals;
+        if (in == input.size()) {
+            if (written != size) fail();
+            return;
+        }
+
+        if (input.size() - in < 2) fail();
+        const std::size_t offset = static_cast<std::uint8_t>(input[in]) | static_cast<std::size_t>(static_cast<std::uint8_t>(input[in + 1])) << 8;
+        in += 2;
+        const std::size_t length = readLength(token & 15) + lzMinMatch;
+        if (offset == 0 || offset > written || length > size - written) fail();
+        if (offset >= length) {
+            std::memcpy(out + written, out + written - offset, length);
+        } else {
+            // Совпадение перекрывается с собственным продолжением, поэтому побайтно
+            for (std::size_t i = 0; i < length; ++i) {
+                out[written + i] = out[written + i - offset];
             }
         }
+        written += length;
+    }
+}
+
+// Распакованные блоки текстов, общие для всех сжатых хранилищ базы: в памяти
+// остаются не больше capacity последних прочитанных блоков. Ключ - номер
+// хранилища (выдаётся при сжатии) и номер блока в нём. Блок, вытесненный
+// из кэша, живёт, пока на него есть ссылки. Можно читать из любого потока.
+class ContentBlockCache {
+public:
+    explicit ContentBlockCache(std::size_t capacity) : capacity(std::max<std::size_t>(1, capacity)) {}
+
+    std::uint64_t newStoreId() {
+        return nextStoreId++;
     }
 
-    void printMessagesFromUserInTimeRange(const std::string& username, const std::string& startTime, const std::string& endTime) const {
-        for (const auto& message : messages) {
-            if (message->username == username && message->time >= startTime && message->time <= endTime) {
-                message->print();
+    // Блок из кэша или, если его нет, результат load()
+    template<class Load>
+    std::shared_ptr<const std::string> get(std::uint64_t store, std::size_t block, Load&& load) {
+        const Key key(store, block);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (auto block = find(key)) {
+                return block;
             }
         }
+
+        std::shared_ptr<const std::string> text = load(); // распаковка - без блокировки
+        std::lock_guard<std::mutex> lock(mutex);
+        if (auto block = find(key)) {
+            return block; // другой поток успел раньше
+        }
+        blocks.emplace_front(key, text);
+        positions.emplace(key, blocks.begin());
+        if (blocks.size() > capacity) {
+            positions.erase(blocks.back().first);
+            blocks.pop_back();
+        }
+        return text;
     }
 
-    void printMessagesInTimeRange(const std::string& startTime, const std::string& endTime) const {
-        for (const auto& message : messages) {
-            if (message->time >= startTime && message->time <= endTime) {
-                message->print();
-            }
+    // Сколько байт занимают распакованные блоки кэша
+    std::size_t memory() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::size_t total = 0;
+        for (const auto& entry : blocks) {
+            total += entry.second->size();
         }
+        return total;
     }
 
 private:
-    std::set<std::shared_ptr<Message>> messages;
+    using Key = std::pair<std::uint64_t, std::size_t>;
+
+    struct KeyHash {
+        std::size_t operator()(const Key& key) const {
+            return std::hash<std::uint64_t>()(key.first * 0x9e3779b97f4a7c15ULL ^ key.second);
+        }
+    };
+
+    std::shared_ptr<const std::string> find(const Key& key) {
+        auto it = positions.find(key);
+        if (it == positions.end()) {
+            return nullptr;
+        }
+        blocks.splice(blocks.begin(), blocks, it->second); // в начале - последние прочитанные
+        return it->second->second;
+    }
+
+    mutable std::mutex mutex;
+    std::size_t capacity;
+    std::atomic<std::uint64_t> nextStoreId{0};
+    std::list<std::pair<Key, std::shared_ptr<const std::string>>> blocks;
+    std::unordered_map<Key, std::list<std::pair<Key, std::shared_ptr<const std::string>>>::iterator, KeyHash> positions;
 };
 
-bool parseDateTime(const std::string& date, const std::string& time) {
-    std::istringstream dateStream(date);
-    std::istringstream timeStream(time);
-    int year, month, day, hour, minute, second, millisecond;
-    char dash, colon, dot;
+// Колоночное хранилище: время, номер пользователя и текст каждого сообщения
+// лежат в отдельных плотных массивах, а тексты - подряд в одном буфере или,
+// если все они уже лежат в памяти одного владельца (например, отображённого
+// файла), остаются там: тогда хранится начало текста каждой строки.
+// Строки упорядочены по времени, так что диапазон времени - это диапазон
+// строк, а фильтры по времени и пользователю проходят только по массивам чисел.
+// Хранилище собирается из готовых столбцов и дальше не меняется.
+// После compressContent() тексты хранятся сжатыми блоками соседних по
+// времени строк и распаковываются (через общий ContentBlockCache), только
+// когда запросу нужен текст.
+class ColumnarMessageStore {
+public:
+    // Чтение текстов по строкам. Держит последний распакованный блок, так что
+    // при чтении строк подряд каждый блок ищется в кэше один раз. Текст,
+    // который вернул read(), действителен до следующего вызова read() или,
+    // пока жив блок, который вернул block().
+    class ContentReader {
+    public:
+        explicit ContentReader(const ColumnarMessageStore& store) : store(store) {}
 
-    // Разбираем дату
-    dateStream >> year >> dash >> month >> dash >> day;
-    if (dateStream.fail() || month > 12 || day > 31 || dash != '-') return false;
+        std::string_view read(std::size_t row) {
+            if (!store.isContentCompressed()) {
+                return store.content(row);
+            }
 
-    // Разбираем время
-    timeStream >> hour >> colon >> minute >> colon >> second >> dot >> millisecond;
-    if (timeStream.fail() || hour > 24 || minute > 60 || second > 60 || millisecond > 999 || dot != '.' || colon != ':') return false;
+            const std::size_t index = store.blockOf(row);
+            if (!block || index != blockIndex) {
+                block = store.loadBlock(index);
+                blockIndex = index;
+            }
+            const std::uint64_t blockStart = store.rawOffset(store.blockFirstRows[index]);
+            const std::uint64_t begin = store.rawOffset(row) - blockStart;
+            return std::string_view(*block).substr(begin, store.contentEnds[row] - blockStart - begin);
+        }
 
-    return true;
-}
+        // Распакованный блок с текстом последнего read() (у несжатого хранилища - пусто)
+        const std::shared_ptr<const std::string>& currentBlock() const {
+            return block;
+        }
 
-std::optional<std::shared_ptr<Message>> parseMessageLine(const std::string& line) {
-    std::istringstream ss(line);
-    std::string username, date, time, content;
+    private:
+        const ColumnarMessageStore& store;
+        std::shared_ptr<const std::string> block;
+        std::size_t blockIndex = 0;
+    };
 
-    if (!(ss >> username >> date >> time)) {
-        throw std::invalid_argument("Failed to parse message line: " + line);
+    ColumnarMessageStore() = default;
+
+    // Столбцы строк в порядке времени: contentEnds - конец текста каждой строки в content
+    ColumnarMessageStore(UserTable users, std::vector<std::int64_t> times, std::vector<std::uint32_t> userIds,
+                         std::vector<std::uint64_t> contentEnds, std::string content)
+        : users(std::move(users)), times(std::move(times)), userIds(std::move(userIds)),
+          contentEnds(std::move(contentEnds)) {
+        auto buffer = std::make_shared<const std::string>(std::move(content));
+        contentBase = buffer->data();
+        owner = std::move(buffer);
     }
 
-    if (!parseDateTime(date, time)) {
-        throw std::invalid_argument("Invalid date/time format.");
+    // Тексты не копируются: текст строки начинается с contentStarts[row] в
+    // памяти owner (длины - по contentEnds), и хранилище держит эту память
+    ColumnarMessageStore(UserTable users, std::vector<std::int64_t> times, std::vector<std::uint32_t> userIds,
+                         std::vector<std::uint64_t> contentEnds, std::vector<const char*> contentStarts,
+                         std::shared_ptr<const void> owner)
+        : users(std::move(users)), times(std::move(times)), userIds(std::move(userIds)),
+          contentEnds(std::move(contentEnds)), contentStarts(std::move(contentStarts)), owner(std::move(owner)) {}
+
+    // Сжимает тексты блоками примерно по blockSize байт (блок - строки подряд,
+    // то есть сообщения, близкие по времени) и отпускает несжатые тексты.
+    // Распакованные блоки держит cache.
+    void compressContent(std::shared_ptr<ContentBlockCache> cache, std::size_t blockSize = 4 * 1024) {
+        if (isContentCompressed()) {
+            return;
+        }
+
+        std::size_t row = 0;
+        while (row < size()) {
+            const std::size_t firstRow = row;
+            const std::uint64_t begin = rawOffset(firstRow);
+            row = firstRow + 1;
+            while (row < size() && contentEnds[row - 1] - begin < blockSize) {
+                ++row;
+            }
+
+            std::string text;
+            text.reserve(rawOffset(row) - begin);
+            for (std::size_t i = firstRow; i < row; ++i) {
+                text.append(content(i));
+            }
+            blockFirstRows.push_back(firstRow);
+            compressedContent.append(lzCompress(text));
+            blockEnds.push_back(compressedContent.size());
+        }
+        compressedContent.shrink_to_fit();
+        contentBase = nullptr;
+        std::vector<const char*>().swap(contentStarts);
+        owner.reset();
+        storeId = cache->newStoreId();
+        this->cache = std::move(cache);
     }
 
-    std::string dateTime = date + " " + time;
+    bool isContentCompressed() const {
+        return cache != nullptr;
+    }
 
+    // Сколько байт текстов занимает в памяти: буфер или сжатые блоки
+    // (распакованные блоки считает кэш, тексты в памяти владельца не считаются)
+    std::size_t contentMemory() const {
+        if (isContentCompressed()) {
+            return compressedContent.size();
+        }
+        return contentStarts.empty() ? rawOffset(size()) : 0;
+    }
 
+    std::size_t size() const {
+        return times.size();
+    }
 
-    ss.ignore(1);
-    std::getline(ss, content);
+    std::int64_t time(std::size_t row) const {
+        return times[row];
+    }
 
+    std::uint32_t userId(std::size_t row) const {
+        return userIds[row];
+    }
 
+    std::string_view username(std::size_t row) const {
+        return users.name(userIds[row]);
+    }
 
-    return std::make_shared<Message>(username, date + " " + time, content);
-}
+    // Текст строки несжатого хранилища (сжатое читается через ContentReader)
+    std::string_view content(std::size_t row) const {
+        if (isContentCompressed()) {
+            throw std::invalid_argument("Content is compressed, read it through ContentReader.");
+        }
+        const std::uint64_t begin = rawOffset(row);
+        const char* text = contentStarts.empty() ? contentBase + begin : contentStarts[row];
+        return std::string_view(text, contentEnds[row] - begin);
+    }
 
-void loadMessagesFromFile(const std::string& filename, MessageDatabase& db) {
-    std::ifstream file(filename);
-    if (!file.is_open()) {
-        throw std::runtime_error("Could not open file: " + filename);
+    // Столбцы целиком, например для записи снимка
+    const UserTable& userTable() const {
+        return users;
     }
 
-    std::string line;
-    while (std::getline(file, line))
-    {
-        auto msgOpt = parseMessageLine(line);
-        if (msgOpt) {
-            db.addMessage(*msgOpt);
+    const std::vector<std::int64_t>& timeColumn() const {
+        return times;
+    }
+
+    const std::vector<std::uint32_t>& userIdColumn() const {
+        return userIds;
+    }
+
+    const std::vector<std::uint64_t>& contentEndColumn() const {
+        return contentEnds;
+    }
+
+    // Память, в которой лежат несжатые тексты (у сжатого хранилища - пусто)
+    const std::shared_ptr<const void>& contentOwner() const {
+        return owner;
+    }
+
+    // Полуинтервал строк со временем в [startTime, endTime]
+    std::pair<std::size_t, std::size_t> rowsInTimeRange(std::int64_t startTime, std::int64_t endTime) const {
+        auto first = std::lower_bound(times.begin(), times.end(), startTime);
+        auto last = std::upper_bound(first, times.end(), endTime);
+        return {static_cast<std::size_t>(first - times.begin()), static_cast<std::size_t>(last - times.begin())};
+    }
+
+private:
+    // Начало текста строки в несжатом потоке текстов
+    std::uint64_t rawOffset(std::size_t row) const {
+        return row == 0 ? 0 : contentEnds[row - 1];
+    }
+
+    std::size_t blockOf(std::size_t row) const {
+        return static_cast<std::size_t>(std::upper_bound(blockFirstRows.begin(), blockFirstRows.end(), row) - blockFirstRows.begin()) - 1;
+    }
+
+    // Распакованный блок: из кэша или распаковкой
+    std::shared_ptr<const std::string> loadBlock(std::size_t index) const {
+        return cache->get(storeId, index, [&]() {
+            const std::uint64_t compressedBegin = index == 0 ? 0 : blockEnds[index - 1];
+            const std::size_t lastRow = index + 1 < blockFirstRows.size() ? blockFirstRows[index + 1] : size();
+            const std::uint64_t rawBegin = rawOffset(blockFirstRows[index]);
+            auto text = std::make_shared<std::string>(rawOffset(lastRow) - rawBegin, '\0');
+            lzDecompress(std::string_view(compressedContent).substr(compressedBegin, blockEnds[index] - compressedBegin),
+                         text->data(), text->size());
+            return std::shared_ptr<const std::string>(std::move(text));
+        });
+    }
+
+    UserTable users;
+    std::vector<std::int64_t> times;
+    std::vector<std::uint32_t> userIds;
+    std::vector<std::uint64_t> contentEnds; // конец текста каждой строки в несжатом потоке текстов
+    // Несжатые тексты: подряд с contentBase или с contentStarts[row] у каждой строки
+    const char* contentBase = nullptr;
+    std::vector<const char*> contentStarts;
+    std::shared_ptr<const void> owner;
+    // Сжатые тексты: первая строка каждого блока и конец блока в compressedContent
+    std::vector<std::size_t> blockFirstRows;
+    std::vector<std::uint64_t> blockEnds;
+    std::string compressedContent;
+    std::shared_ptr<ContentBlockCache> cache; // есть только у сжатого хранилища
+    std::uint64_t storeId = 0;
+};
+
+// Вызывает callback для каждого слова текста. Слово - непрерывная последовательность
+// букв и цифр, латиница приводится к нижнему регистру, байты UTF-8 остаются как есть.
+template<class Callback>
+void forEachTerm(std::string_view text, Callback&& callback) {
+    std::string term;
+    for (std::size_t pos = 0; pos <= text.size(); ++pos) {
+        const unsigned char c = pos < text.size() ? static_cast<unsigned char>(text[pos]) : ' ';
+        if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80) {
+            term.push_back(static_cast<char>(c));
+        } else if (c >= 'A' && c <= 'Z') {
+            term.push_back(static_cast<char>(c - 'A' + 'a'));
+        } else if (!term.empty()) {
+            callback(term);
+            term.clear();
         }
     }
 }
 
-int main() {
-    try {
-        MessageDatabase db;
+// Закодированный список номеров (байты PostingList) в памяти индекса
+struct EncodedPostings {
+    const std::uint8_t* data;
+    std::size_t size;
+};
+
+// Номера из закодированного списка по возрастанию. Список, прочитанный из
+// снимка, может быть повреждён: чтение не выходит за конец байтов, а номер
+// не меньше limit (числа сообщений, на которые ссылается список) считается ошибкой.
+inline std::vector<std::uint32_t> decodePostings(EncodedPostings list, std::uint64_t limit = std::uint64_t(1) << 32) {
+    std::vector<std::uint32_t> ids;
+    ids.reserve(list.size);
+    std::uint64_t id = 0;
+    std::size_t pos = 0;
+    while (pos < list.size) {
+        std::uint64_t delta = 0;
+        for (int shift = 0;; shift += 7) {
+            if (pos == list.size || shift > 28) {
+                throw std::runtime_error("Corrupted posting list: bad varint.");
+            }
+            std::uint8_t byte = list.data[pos++];
+            delta |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) break;
+        }
+        id += delta;
+        if (id >= limit) {
+            throw std::runtime_error("Corrupted posting list: message id out of range.");
+        }
+        ids.push_back(static_cast<std::uint32_t>(id));
+    }
+    return ids;
+}
+
+// Сжатый список номеров сообщений. Номера добавляются по возрастанию
+// и хранятся разностями с предыдущим в формате varint (7 бит на байт).
+class PostingList {
+public:
+    void add(std::uint32_t id) {
+        if (count > 0 && id == last) {
+            return; // слово повторилось в том же сообщении
+        }
+
+        std::uint32_t delta = count == 0 ? id : id - last;
+        while (delta >= 0x80) {
+            bytes.push_back(static_cast<std::uint8_t>(delta | 0x80));
+            delta >>= 7;
+        }
+        bytes.push_back(static_cast<std::uint8_t>(delta));
+        last = id;
+        ++count;
+    }
+
+    // Номера по возрастанию (про limit - см. decodePostings)
+    std::vector<std::uint32_t> decode(std::uint64_t limit = std::uint64_t(1) << 32) const {
+        return decodePostings(view(), limit);
+    }
+
+    std::size_t size() const {
+        return count;
+    }
+
+    std::uint32_t lastId() const {
+        return last;
+    }
+
+    const std::vector<std::uint8_t>& encoded() const {
+        return bytes;
+    }
+
+    EncodedPostings view() const {
+        return {bytes.data(), bytes.size()};
+    }
+
+private:
+    std::vector<std::uint8_t> bytes;
+    std::uint32_t last = 0;
+    std::uint32_t count = 0;
+};
+
+enum class TermMatch {
+    All, // сообщение содержит все слова
+    Any  // сообщение содержит хотя бы одно слово
+};
+
+// Фильтр Блума над строками: если mayContain() вернул false, строку точно
+// не добавляли. На строку приходится около 10 бит и 7 хэшей (ложные
+// срабатывания - около 1%). Удалять строки нельзя; когда строк становится
+// больше расчётного числа (full()), владелец перестраивает фильтр большего
+// размера по своему точному множеству.
+class BloomFilter {
+public:
+    explicit BloomFilter(std::size_t capacity = 64)
+        : bits((std::max<std::size_t>(capacity, 1) * bitsPerValue + 63) / 64), limit(std::max<std::size_t>(capacity, 1)) {}
+
+    void add(std::string_view value) {
+        auto [hash, step] = hashes(value);
+        const std::uint64_t bitCount = bits.size() * 64;
+        for (int i = 0; i < hashCount; ++i, hash += step) {
+            const std::uint64_t bit = hash % bitCount;
+            bits[bit / 64] |= std::uint64_t(1) << (bit % 64);
+        }
+        ++count;
+    }
+
+    bool mayContain(std::string_view value) const {
+        auto [hash, step] = hashes(value);
+        const std::uint64_t bitCount = bits.size() * 64;
+        for (int i = 0; i < hashCount; ++i, hash += step) {
+            const std::uint64_t bit = hash % bitCount;
+            if (!(bits[bit / 64] & (std::uint64_t(1) << (bit % 64)))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool full() const {
+        return count >= limit;
+    }
+
+private:
+    static constexpr std::size_t bitsPerValue = 10;
+    static constexpr int hashCount = 7;
+
+    // Два независимых хэша для схемы h1 + i * h2
+    static std::pair<std::uint64_t, std::uint64_t> hashes(std::string_view value) {
+        const std::uint64_t hash = std::hash<std::string_view>()(value);
+        const std::uint64_t mixed = (hash ^ (hash >> 29)) * 0xbf58476d1ce4e5b9ULL;
+        return {hash, (mixed ^ (mixed >> 32)) | 1};
+    }
+
+    std::vector<std::uint64_t> bits;
+    std::size_t limit;     // на сколько строк рассчитан фильтр
+    std::size_t count = 0; // сколько строк добавлено
+};
+
+// Проверка запроса по фильтру Блума слов индекса: false - ни одно сообщение
+// точно не подходит (списки не читаются)
+inline bool mayMatchTerms(const BloomFilter& termFilter, const std::vector<std::string>& terms, TermMatch match) {
+    bool any = false;
+    bool all = true;
+    for (const auto& query : terms) {
+        forEachTerm(query, [&](const std::string& term) {
+            if (termFilter.mayContain(term)) {
+                any = true;
+            } else {
+                all = false;
+            }
+        });
+    }
+    return match == TermMatch::All ? all && any : any;
+}
+
+// Номера сообщений по возрастанию, подходящих под запрос. lookup(слово)
+// возвращает список слова или {nullptr, 0}, если слова в индексе нет.
+template<class Lookup>
+std::vector<std::uint32_t> findPostings(const std::vector<std::string>& terms, TermMatch match, Lookup&& lookup,
+                                        std::uint64_t limit = std::uint64_t(1) << 32) {
+    std::vector<EncodedPostings> lists;
+    for (const auto& query : terms) {
+        bool missing = false;
+        forEachTerm(query, [&](const std::string& term) {
+            EncodedPostings list = lookup(term);
+            if (list.data) {
+                lists.push_back(list);
+            } else {
+                missing = true;
+            }
+        });
+        if (missing && match == TermMatch::All) {
+            return {};
+        }
+    }
+    if (lists.empty()) {
+        return {};
+    }
+
+    // Пересечение начинаем с самого короткого списка
+    if (match == TermMatch::All) {
+        std::sort(lists.begin(), lists.end(), [](const EncodedPostings& a, const EncodedPostings& b) {
+            return a.size < b.size;
+        });
+    }
+
+    std::vector<std::uint32_t> result = decodePostings(lists.front(), limit);
+    std::vector<std::uint32_t> merged;
+    for (std::size_t i = 1; i < lists.size() && !(match == TermMatch::All && result.empty()); ++i) {
+        std::vector<std::uint32_t> ids = decodePostings(lists[i], limit);
+        merged.clear();
+        if (match == TermMatch::All) {
+            std::set_intersection(result.begin(), result.end(), ids.begin(), ids.end(), std::back_inserter(merged));
+        } else {
+            std::set_union(result.begin(), result.end(), ids.begin(), ids.end(), std::back_inserter(merged));
+        }
+        result.swap(merged);
+    }
+    return result;
+}
+
+// Инвертированный индекс: слово -> номера сообщений, в которых оно встречается
+class TextIndex {
+public:
+    void add(std::uint32_t id, std::string_view content) {
+        forEachTerm(content, [&](const std::string& term) {
+            auto [it, inserted] = postings.try_emplace(term);
+            it->second.add(id);
+            if (inserted) {
+                addToFilter(it->first);
+            }
+        });
+    }
+
+    void addPostingList(std::string term, PostingList list) {
+        auto [it, inserted] = postings.insert_or_assign(std::move(term), std::move(list));
+        if (inserted) {
+            addToFilter(it->first);
+        }
+    }
+
+    // false - ни одно сообщение точно не подходит под запрос (проверка
+    // только по фильтру Блума, без списков)
+    bool mayMatch(const std::vector<std::string>& terms, TermMatch match) const {
+        return mayMatchTerms(termFilter, terms, match);
+    }
+
+    template<class Callback>
+    void forEachPostingList(Callback&& callback) const {
+        for (const auto& [term, list] : postings) {
+            callback(term, list);
+        }
+    }
+
+    std::size_t termCount() const {
+        return postings.size();
+    }
+
+    // Номера сообщений по возрастанию
+    std::vector<std::uint32_t> find(const std::vector<std::string>& terms, TermMatch match) const {
+        return findPostings(terms, match, [&](const std::string& term) {
+            auto it = postings.find(term);
+            return it == postings.end() ? EncodedPostings{nullptr, 0} : it->second.view();
+        });
+    }
+
+private:
+    void addToFilter(std::string_view term) {
+        if (termFilter.full()) {
+            termFilter = BloomFilter(postings.size() * 2);
+            for (const auto& entry : postings) {
+                termFilter.add(entry.first);
+            }
+            return;
+        }
+        termFilter.add(term);
+    }
+
+    std::unordered_map<std::string, PostingList> postings;
+    // Какие слова есть в индексе, чтобы отсеивать запросы, не трогая postings
+    BloomFilter termFilter;
+};
+
+// Дополнительные условия поиска по тексту
+struct MessageFilter {
+    std::optional<std::string> username;
+    std::int64_t startTime = std::numeric_limits<std::int64_t>::min();
+    std::int64_t endTime = std::numeric_limits<std::int64_t>::max();
+};
+
+// Файл, отображённый в память только для чтения
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open file: " + filename);
+        }
+
+        struct stat info;
+        if (::fstat(fd, &info) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Could not stat file: " + filename);
+        }
+
+        size = static_cast<std::size_t>(info.st_size);
+        if (size > 0) {
+            void* address = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Could not map file: " + filename);
+            }
+            ::madvise(address, size, MADV_SEQUENTIAL);
+            data = static_cast<const char*>(address);
+        }
+        ::close(fd);
+    }
+
+    ~MappedFile() {
+        if (data) {
+            ::munmap(const_cast<char*>(data), size);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    std::string_view view() const {
+        return std::string_view(data, size);
+    }
+
+private:
+    const char* data = nullptr;
+    std::size_t size = 0;
+};
+
+// Дожидается попадания содержимого файла на диск
+inline void syncFile(int fd, const std::string& filename) {
+#ifdef __APPLE__
+    // fsync на macOS не сбрасывает кэш самого диска
+    int result = ::fcntl(fd, F_FULLFSYNC);
+#else
+    int result = ::fsync(fd);
+#endif
+    if (result != 0) {
+        throw std::runtime_error("Could not sync file: " + filename);
+    }
+}
+
+inline void syncFile(const std::string& filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open file: " + filename);
+    }
+    try {
+        syncFile(fd, filename);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+}
+
+// Каталог, в котором лежит файл
+inline std::string directoryOf(const std::string& filename) {
+    std::size_t slash = filename.rfind('/');
+    return slash == std::string::npos ? "." : filename.substr(0, std::max<std::size_t>(slash, 1));
+}
+
+// Сбрасывает на диск каталог файла: без этого созданный или переименованный
+// файл может после сбоя питания оказаться под прежним именем или пропасть
+inline void syncDirectoryOf(const std::string& filename) {
+    const std::string directory = directoryOf(filename);
+    int fd = ::open(directory.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open directory: " + directory);
+    }
+    int result = ::fsync(fd);
+    int error = errno;
+    ::close(fd);
+    // Некоторые файловые системы не умеют сбрасывать каталоги
+    if (result != 0 && error != EINVAL) {
+        throw std::runtime_error("Could not sync directory: " + directory);
+    }
+}
+
+// Снимок базы на диске (порядок байт - как на записавшей машине). За заголовком
+// базы идут сегменты по времени, все запечатанные: заголовок сегмента и его
+// столбцы и индексы (см. SegmentColumns) секциями, каждая выровнена на 8 байт.
+// Загрузка копирует секции в столбцы как есть, без разбора текстов и без
+// перестройки индексов.
+struct SnapshotHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t journalGeneration; // поколение журнала, которое повторяется поверх снимка
+    // Параметры, от которых зависят границы сегментов и промежутки бесед
+    std::int64_t segmentSpan;
+    std::int64_t conversationGap;
+    std::uint64_t segmentCount;
+};
+
+// Секции сегмента: концы имён (uint64) и имена; время (int64), номера
+// пользователей (uint32) и концы текстов (uint64) строк и тексты; строки
+// пользователей (userRowStarts, userRows - uint32); хэши ключей (uint64) и их
+// строки (uint32, хэши - messageKeyHash); концы слов (uint64) и слова; концы списков (uint64) и их
+// байты; начала промежутков бесед пользователей (uint32) и сами промежутки
+// по полям: собеседник (uint32), начало и конец (int64).
+struct SnapshotSegmentHeader {
+    std::int64_t startTime;
+    std::int64_t periodEnd;
+    std::uint64_t rowCount;
+    std::uint64_t userCount;
+    std::uint64_t userNamesSize;
+    std::uint64_t contentSize;
+    std::uint64_t termCount;
+    std::uint64_t termBytesSize;
+    std::uint64_t postingBytesSize;
+    std::uint64_t spanCount;
+};
+
+constexpr char snapshotMagic[8] = {'M', 'S', 'G', 'S', 'N', 'A', 'P', '\0'};
+constexpr std::uint32_t snapshotVersion = 3;
+
+template<class T>
+void writeSnapshotSection(std::ostream& out, const T* data, std::size_t count) {
+    static const char padding[8] = {};
+    const std::size_t size = count * sizeof(T);
+    out.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+    out.write(padding, static_cast<std::streamsize>((8 - size % 8) % 8));
+}
+
+inline void appendUint32(std::string& out, std::uint32_t value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// Последовательное чтение секций снимка с проверкой границ
+class SnapshotReader {
+public:
+    explicit SnapshotReader(std::string_view data) : data(data) {}
+
+    template<class T>
+    const T* section(std::uint64_t count) {
+        if (count > (data.size() - pos) / sizeof(T)) {
+            throw std::runtime_error("Corrupted snapshot: section is out of bounds.");
+        }
+
+        const T* result = reinterpret_cast<const T*>(data.data() + pos);
+        pos = std::min<std::uint64_t>(data.size(), pos + (count * sizeof(T) + 7) / 8 * 8);
+        return result;
+    }
+
+    // Секция, скопированная в столбец
+    template<class T>
+    std::vector<T> column(std::uint64_t count) {
+        const T* values = section<T>(count);
+        return std::vector<T>(values, values + count);
+    }
+
+private:
+    std::string_view data;
+    std::uint64_t pos = 0;
+};
+
+enum class JournalOperation : std::uint8_t {
+    Add = 1,
+    Remove = 2,
+    RemoveUser = 3,
+    DropBefore = 4
+};
+
+// Журнал изменений базы: записи только дописываются в конец файла.
+// Записи копятся в буфере и сбрасываются на диск группой (write + fsync)
+// при commit() или когда их набирается groupSize.
+// Файл начинается с заголовка [метка 8 байт][поколение u32][0 u32]. Поколение
+// увеличивается при каждом снимке, так что журнал, изменения которого уже
+// вошли в снимок, можно отличить от журнала, который нужно повторить.
+// Формат записи: [размер тела u32][контрольная сумма тела u32] +
+// тело [операция u8][время i64][длина имени u32][имя][текст].
+class MutationJournal {
+public:
+    MutationJournal(const std::string& filename, std::uint32_t generation, std::size_t groupSize = 1024)
+        : filename(filename), groupSize(groupSize) {
+        fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open file: " + filename);
+        }
+
+        char header[headerSize];
+        if (::pread(fd, header, headerSize, 0) != static_cast<ssize_t>(headerSize) ||
+            !std::equal(std::begin(journalMagic), std::end(journalMagic), header) ||
+            readGeneration(header) != generation) {
+            try {
+                restart(generation);
+                syncDirectoryOf(filename); // файл журнала мог быть только что создан
+            } catch (...) {
+                ::close(fd);
+                throw;
+            }
+        }
+    }
+
+    ~MutationJournal() {
+        try {
+            commit();
+        } catch (const std::exception& ex) {
+            std::cerr << "Journal commit failed: " << ex.what() << std::endl;
+        }
+        ::close(fd);
+    }
+
+    MutationJournal(const MutationJournal&) = delete;
+    MutationJournal& operator=(const MutationJournal&) = delete;
+
+    void append(JournalOperation operation, std::string_view username, std::int64_t time, std::string_view content) {
+        std::string body;
+        body.reserve(1 + sizeof(time) + sizeof(std::uint32_t) + username.size() + content.size());
+        body.push_back(static_cast<char>(operation));
+        body.append(reinterpret_cast<const char*>(&time), sizeof(time));
+        appendUint32(body, static_cast<std::uint32_t>(username.size()));
+        body.append(username).append(content);
+
+        appendUint32(pending, static_cast<std::uint32_t>(body.size()));
+        appendUint32(pending, checksum(body));
+        pending.append(body);
+        if (++pendingRecords >= groupSize) {
+            commit();
+        }
+    }
+
+    // Записывает накопленную группу и дожидается её попадания на диск
+    void commit() {
+        if (pending.empty()) {
+            return;
+        }
+
+        writeAll(pending);
+        syncFile(fd, filename);
+        pending.clear();
+        pendingRecords = 0;
+    }
+
+    // Начинает журнал заново с новым поколением (после записи снимка)
+    void restart(std::uint32_t generation) {
+        pending.clear();
+        pendingRecords = 0;
+        if (::ftruncate(fd, 0) != 0) {
+            throw std::runtime_error("Could not truncate file: " + filename);
+        }
+
+        std::string header(journalMagic, sizeof(journalMagic));
+        appendUint32(header, generation);
+        appendUint32(header, 0);
+        writeAll(header);
+        syncFile(fd, filename);
+    }
+
+    // Повторяет записи журнала поколения generation. Журнал более старого
+    // поколения уже вошёл в снимок и пропускается. Оборванная или повреждённая
+    // запись в конце (сбой во время записи) и всё после неё отбрасываются.
+    template<class Callback>
+    static void replay(const std::string& filename, std::uint32_t generation, Callback&& callback) {
+        if (!std::ifstream(filename).is_open()) {
+            return; // журнала ещё нет
+        }
+
+        MappedFile file(filename);
+        std::string_view data = file.view();
+        if (data.size() < headerSize) {
+            return; // сбой при создании журнала, записей в нём нет
+        }
+        if (!std::equal(std::begin(journalMagic), std::end(journalMagic), data.data())) {
+            throw std::runtime_error("Not a journal file: " + filename);
+        }
+
+        std::uint32_t fileGeneration = readGeneration(data.data());
+        if (fileGeneration < generation) {
+            return;
+        }
+        if (fileGeneration > generation) {
+            throw std::runtime_error("Journal " + filename + " is newer than the loaded snapshot.");
+        }
+
+        const std::size_t recordHeaderSize = 2 * sizeof(std::uint32_t);
+        const std::size_t fixedSize = 1 + sizeof(std::int64_t) + sizeof(std::uint32_t);
+        std::size_t pos = headerSize;
+        while (data.size() - pos >= recordHeaderSize) {
+            std::uint32_t size, sum;
+            std::memcpy(&size, data.data() + pos, sizeof(size));
+            std::memcpy(&sum, data.data() + pos + sizeof(size), sizeof(sum));
+            if (size < fixedSize || data.size() - pos - recordHeaderSize < size) break;
+
+            std::string_view body = data.substr(pos + recordHeaderSize, size);
+            if (checksum(body) != sum) break;
+
+            auto operation = static_cast<JournalOperation>(body[0]);
+            std::int64_t time;
+            std::uint32_t usernameSize;
+            std::memcpy(&time, body.data() + 1, sizeof(time));
+            std::memcpy(&usernameSize, body.data() + 1 + sizeof(time), sizeof(usernameSize));
+            if (usernameSize > size - fixedSize) break;
+
+            callback(operation, body.substr(fixedSize, usernameSize), time, body.substr(fixedSize + usernameSize));
+            pos += recordHeaderSize + size;
+        }
+
+        if (pos < data.size()) {
+            std::cerr << "Journal " << filename << ": dropped " << data.size() - pos << " bytes of incomplete records.\n";
+            if (::truncate(filename.c_str(), static_cast<off_t>(pos)) != 0) {
+                throw std::runtime_error("Could not truncate file: " + filename);
+            }
+        }
+    }
+
+private:
+    static constexpr char journalMagic[8] = {'M', 'S', 'G', 'J', 'R', 'N', 'L', '\0'};
+    static constexpr std::size_t headerSize = sizeof(journalMagic) + 2 * sizeof(std::uint32_t);
+
+    static std::uint32_t readGeneration(const char* header) {
+        std::uint32_t generation;
+        std::memcpy(&generation, header + sizeof(journalMagic), sizeof(generation));
+        return generation;
+    }
+
+    // FNV-1a
+    static std::uint32_t checksum(std::string_view data) {
+        std::uint32_t hash = 2166136261u;
+        for (char c : data) {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+        }
+        return hash;
+    }
+
+    void writeAll(std::string_view data) {
+        std::size_t written = 0;
+        while (written < data.size()) {
+            ssize_t result = ::write(fd, data.data() + written, data.size() - written);
+            if (result < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error("Could not write file: " + filename);
+            }
+            written += static_cast<std::size_t>(result);
+        }
+    }
+
+    std::string filename;
+    std::size_t groupSize;
+    int fd = -1;
+    std::string pending;
+    std::size_t pendingRecords = 0;
+};
+
+constexpr std::int64_t millisecondsPerMinute = 60000;
+constexpr std::int64_t millisecondsPerHour = 60 * millisecondsPerMinute;
+constexpr std::int64_t millisecondsPerDay = 24 * millisecondsPerHour;
+
+// Начало промежутка длины span, в который попадает время (деление с округлением вниз)
+constexpr std::int64_t floorToMultiple(std::int64_t time, std::int64_t span) {
+    std::int64_t index = time / span;
+    if (time % span < 0) {
+        --index;
+    }
+    return index * span;
+}
+
+// Число сообщений, начиная с момента start
+struct CountBucket {
+    std::int64_t start;
+    std::uint64_t count;
+};
+
+// Между сообщениями в earlier и later (earlier <= later) не больше gap
+inline bool withinGap(std::int64_t earlier, std::int64_t later, std::int64_t gap) {
+    return static_cast<std::uint64_t>(later) - static_cast<std::uint64_t>(earlier) <= static_cast<std::uint64_t>(gap);
+}
+
+// Беседа двух пользователей: их сообщения подряд, без пауз длиннее
+// заданного промежутка, в которых отвечал каждый из двоих
+struct Conversation {
+    std::string firstUser; // имена по алфавиту
+    std::string secondUser;
+    std::vector<MessagePtr> messages; // в порядке времени
+
+    std::int64_t startTime() const {
+        return messages.front()->time;
+    }
+
+    std::int64_t endTime() const {
+        return messages.back()->time;
+    }
+};
+
+// Приближённый подсчёт самых активных пользователей (алгоритм Space-Saving).
+// Хранит не больше capacity счётчиков: новый пользователь при заполненном
+// наброске занимает счётчик с наименьшим значением, а число сообщений
+// вытесненного пользователя становится погрешностью для новых счётчиков,
+// поэтому оценка count завышена не больше чем на error.
+// При capacity = 0 набросок выключен и ничего не считает.
+// Имена, переданные в add(), должны жить не меньше наброска (в сегменте они
+// лежат в его арене): по ним ищутся счётчики, а строка копируется в счётчик
+// только при его создании.
+class HeavyHitterSketch {
+public:
+    struct Counter {
+        std::string username;
+        std::uint64_t count;
+        std::uint64_t error;
+    };
+
+    explicit HeavyHitterSketch(std::size_t capacity = 0) : capacity(capacity) {}
+
+    bool enabled() const {
+        return capacity > 0;
+    }
+
+    // Больше этого числа сообщений не может быть у пользователя, которого нет в наброске
+    std::uint64_t absentLimit() const {
+        return evictedCount;
+    }
+
+    const std::vector<Counter>& counters() const {
+        return heap;
+    }
+
+    // Набросок по точным числам сообщений (у запечатанного сегмента): остаются
+    // capacity самых активных пользователей без погрешности. Такой набросок
+    // только читается.
+    static HeavyHitterSketch fromCounts(std::size_t capacity, std::vector<Counter> counts) {
+        HeavyHitterSketch sketch(capacity);
+        if (!sketch.enabled()) {
+            return sketch;
+        }
+        std::sort(counts.begin(), counts.end(), [](const Counter& a, const Counter& b) {
+            return a.count > b.count;
+        });
+        if (counts.size() > capacity) {
+            sketch.evictedCount = counts[capacity].count;
+            counts.resize(capacity);
+        }
+        // Массив по возрастанию - уже куча с наименьшим счётчиком в вершине
+        std::reverse(counts.begin(), counts.end());
+        sketch.heap = std::move(counts);
+        return sketch;
+    }
+
+    void add(std::string_view username) {
+        if (!enabled()) {
+            return;
+        }
+
+        auto it = positions.find(username);
+        if (it != positions.end()) {
+            ++heap[it->second].count;
+            siftDown(it->second);
+        } else if (heap.size() < capacity) {
+            positions.emplace(username, heap.size());
+            heap.push_back({std::string(username), evictedCount + 1, evictedCount});
+            siftUp(heap.size() - 1);
+        } else {
+            Counter& smallest = heap.front();
+            evictedCount = std::max(evictedCount, smallest.count);
+            positions.erase(smallest.username);
+            positions.emplace(username, 0);
+            smallest = {std::string(username), evictedCount + 1, evictedCount};
+            siftDown(0);
+        }
+    }
+
+    // Учитывает удаление сообщения пользователя
+    void remove(std::string_view username) {
+        auto it = positions.find(username);
+        if (it == positions.end()) {
+            return;
+        }
+
+        std::size_t i = it->second;
+        Counter& counter = heap[i];
+        if (--counter.count == 0) {
+            erase(i);
+            return;
+        }
+        counter.error = std::min(counter.error, counter.count);
+        siftUp(i);
+    }
+
+    // Забывает пользователя целиком (все его сообщения удалены)
+    void removeUser(std::string_view username) {
+        auto it = positions.find(username);
+        if (it != positions.end()) {
+            erase(it->second);
+        }
+    }
+
+private:
+    // Куча с наименьшим счётчиком в вершине, positions - номер счётчика пользователя в куче
+    void swapCounters(std::size_t a, std::size_t b) {
+        std::swap(heap[a], heap[b]);
+        positions.find(heap[a].username)->second = a;
+        positions.find(heap[b].username)->second = b;
+    }
+
+    void siftUp(std::size_t i) {
+        while (i > 0 && heap[i].count < heap[(i - 1) / 2].count) {
+            swapCounters(i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+
+    void siftDown(std::size_t i) {
+        while (true) {
+            std::size_t smallest = i;
+            for (std::size_t child = 2 * i + 1; child <= 2 * i + 2 && child < heap.size(); ++child) {
+                if (heap[child].count < heap[smallest].count) {
+                    smallest = child;
+                }
+            }
+            if (smallest == i) {
+                return;
+            }
+            swapCounters(i, smallest);
+            i = smallest;
+        }
+    }
+
+    void erase(std::size_t i) {
+        positions.erase(heap[i].username);
+        if (i + 1 < heap.size()) {
+            heap[i] = std::move(heap.back());
+            positions.find(heap[i].username)->second = i;
+            heap.pop_back();
+            siftUp(i);
+            siftDown(i);
+        } else {
+            heap.pop_back();
+        }
+    }
+
+    std::size_t capacity;
+    // Наибольший счётчик, который был вытеснен из наброска
+    std::uint64_t evictedCount = 0;
+    std::vector<Counter> heap;
+    // Ключи указывают на имена, переданные в add(), а не в строки счётчиков:
+    // те перемещаются вместе со счётчиками
+    std::unordered_map<std::string_view, std::size_t> positions;
+};
+
+// Запечатанный сегмент: его сообщения - строки колоночного хранилища в порядке
+// времени, а индексы - плоские массивы номеров строк вместо деревьев и хэш-таблиц:
+//   userRowStarts/userRows - строки каждого пользователя по возрастанию
+//     (строки пользователя id - с userRowStarts[id] до userRowStarts[id + 1]);
+//   keyHashes/keyRows - хэши ключей сообщений по возрастанию и их строки;
+//   termEnds/termBytes - слова текстового индекса по алфавиту подряд,
+//     postingEnds/postingBytes - их списки строк (в формате PostingList);
+//   spanStarts/spans - промежутки бесед каждого пользователя по собеседнику
+//     и времени начала.
+// Поминутные числа сообщений находятся двоичным поиском по времени, а фильтры
+// Блума и набросок активных пользователей строятся при создании.
+class SegmentColumns {
+public:
+    struct Span {
+        std::uint32_t partner;
+        std::int64_t from;
+        std::int64_t to;
+    };
+
+    struct Indexes {
+        std::vector<std::uint32_t> userRowStarts;
+        std::vector<std::uint32_t> userRows;
+        std::vector<std::uint64_t> keyHashes;
+        std::vector<std::uint32_t> keyRows;
+        std::vector<std::uint64_t> termEnds;
+        std::string termBytes;
+        std::vector<std::uint64_t> postingEnds;
+        std::vector<std::uint8_t> postingBytes;
+        std::vector<std::uint32_t> spanStarts;
+        std::vector<Span> spans;
+    };
+
+    SegmentColumns(ColumnarMessageStore store, Indexes indexes, std::size_t sketchCapacity)
+        : store(std::move(store)), index(std::move(indexes)), userFilter(users().size()), termFilter(termCount()) {
+        std::vector<HeavyHitterSketch::Counter> counts;
+        for (std::uint32_t id = 0; id < users().size(); ++id) {
+            userFilter.add(users().name(id));
+            if (std::uint64_t count = index.userRowStarts[id + 1] - index.userRowStarts[id]) {
+                counts.push_back({std::string(users().name(id)), count, 0});
+            }
+        }
+        for (std::size_t i = 0; i < termCount(); ++i) {
+            termFilter.add(term(i));
+        }
+        activity = HeavyHitterSketch::fromCounts(sketchCapacity, std::move(counts));
+    }
+
+    // Столбцы подряд идущих по времени запечатанных частей (сегментов одного
+    // периода). Строки частей сдвигаются, номера имён переводятся в общую
+    // таблицу, а промежутки бесед одной пары, которые теперь соприкасаются,
+    // сливаются, как в MessageSegment. Тексты частей, лежащие в памяти одного
+    // владельца, там и остаются, иначе копируются. Если задан contentCache,
+    // тексты сжимаются.
+    static std::shared_ptr<const SegmentColumns> concatenate(const std::vector<const SegmentColumns*>& parts,
+                                                             std::size_t sketchCapacity, std::int64_t conversationGap,
+                                                             const std::shared_ptr<ContentBlockCache>& contentCache) {
+        std::vector<std::string_view> names;
+        for (const SegmentColumns* part : parts) {
+            for (std::uint32_t id = 0; id < part->users().size(); ++id) {
+                names.push_back(part->users().name(id));
+            }
+        }
+        UserTable users(std::move(names));
+        std::vector<std::vector<std::uint32_t>> userIdOf(parts.size());
+        for (std::size_t i = 0; i < parts.size(); ++i) {
+            for (std::uint32_t id = 0; id < parts[i]->users().size(); ++id) {
+                userIdOf[i].push_back(*users.find(parts[i]->users().name(id)));
+            }
+        }
+
+        std::shared_ptr<const void> owner = parts.front()->store.contentOwner();
+        for (const SegmentColumns* part : parts) {
+            if (part->store.contentOwner() != owner) {
+                owner = nullptr;
+            }
+        }
+
+        std::vector<std::int64_t> times;
+        std::vector<std::uint32_t> userIds;
+        std::vector<std::uint64_t> contentEnds;
+        std::vector<const char*> contentStarts;
+        std::string content;
+        std::uint64_t contentSize = 0;
+        std::vector<std::uint32_t> firstRows;
+        for (std::size_t i = 0; i < parts.size(); ++i) {
+            const ColumnarMessageStore& rows = parts[i]->store;
+            ColumnarMessageStore::ContentReader reader(rows);
+            firstRows.push_back(static_cast<std::uint32_t>(times.size()));
+            for (std::size_t row = 0; row < rows.size(); ++row) {
+                times.push_back(rows.time(row));
+                userIds.push_back(userIdOf[i][rows.userId(row)]);
+                const std::string_view text = reader.read(row);
+                if (owner) {
+                    contentStarts.push_back(text.data());
+                } else {
+                    content.append(text);
+                }
+                contentSize += text.size();
+                contentEnds.push_back(contentSize);
+            }
+        }
+
+        Indexes index;
+        indexUserRows(userIds, users.size(), index);
+        std::vector<std::pair<std::uint64_t, std::uint32_t>> keys;
+        keys.reserve(times.size());
+        for (std::size_t i = 0; i < parts.size(); ++i) {
+            const Indexes& part = parts[i]->index;
+            for (std::size_t k = 0; k < part.keyHashes.size(); ++k) {
+                keys.emplace_back(part.keyHashes[k], part.keyRows[k] + firstRows[i]);
+            }
+        }
+        indexKeys(std::move(keys), index);
+
+        // Списки одного слова из разных частей идут друг за другом
+        std::vector<std::pair<std::string_view, std::size_t>> terms;
+        for (std::size_t i = 0; i < parts.size(); ++i) {
+            for (std::size_t t = 0; t < parts[i]->termCount(); ++t) {
+                terms.emplace_back(parts[i]->term(t), i);
+            }
+        }
+        std::stable_sort(terms.begin(), terms.end(), [](const auto& a, const auto& b) {
+            return a.first < b.first;
+        });
+        std::vector<std::size_t> nextTerm(parts.size(), 0);
+        for (std::size_t begin = 0; begin < terms.size();) {
+            std::size_t end = begin;
+            PostingList list;
+            for (; end < terms.size() && terms[end].first == terms[begin].first; ++end) {
+                const std::size_t i = terms[end].second;
+                for (std::uint32_t row : decodePostings(parts[i]->postings(nextTerm[i]++))) {
+                    list.add(row + firstRows[i]);
+                }
+            }
+            index.termBytes.append(terms[begin].first);
+            index.termEnds.push_back(index.termBytes.size());
+            index.postingBytes.insert(index.postingBytes.end(), list.encoded().begin(), list.encoded().end());
+            index.postingEnds.push_back(index.postingBytes.size());
+            begin = end;
+        }
+
+        std::vector<std::vector<Span>> spansOf(users.size());
+        for (std::size_t i = 0; i < parts.size(); ++i) {
+            const Indexes& part = parts[i]->index;
+            for (std::uint32_t id = 0; id + 1 < part.spanStarts.size(); ++id) {
+                for (std::uint32_t k = part.spanStarts[id]; k < part.spanStarts[id + 1]; ++k) {
+                    const Span& span = part.spans[k];
+                    spansOf[userIdOf[i][id]].push_back({userIdOf[i][span.partner], span.from, span.to});
+                }
+            }
+        }
+        index.spanStarts.assign(users.size() + 1, 0);
+        for (std::uint32_t id = 0; id < users.size(); ++id) {
+            std::vector<Span>& spans = spansOf[id];
+            std::sort(spans.begin(), spans.end(), [](const Span& a, const Span& b) {
+                return std::tie(a.partner, a.from) < std::tie(b.partner, b.from);
+            });
+            for (const Span& span : spans) {
+                Span* previous = index.spans.size() > index.spanStarts[id] ? &index.spans.back() : nullptr;
+                if (previous && previous->partner == span.partner &&
+                    (span.from <= previous->to || withinGap(previous->to, span.from, conversationGap))) {
+                    previous->to = std::max(previous->to, span.to);
+                } else {
+                    index.spans.push_back(span);
+                }
+            }
+            index.spanStarts[id + 1] = static_cast<std::uint32_t>(index.spans.size());
+        }
+
+        ColumnarMessageStore store = owner ? ColumnarMessageStore(std::move(users), std::move(times), std::move(userIds),
+                                                                  std::move(contentEnds), std::move(contentStarts), owner)
+                                           : ColumnarMessageStore(std::move(users), std::move(times), std::move(userIds),
+                                                                  std::move(contentEnds), std::move(content));
+        if (contentCache) {
+            store.compressContent(contentCache);
+        }
+        return std::make_shared<const SegmentColumns>(std::move(store), std::move(index), sketchCapacity);
+    }
+
+    // Строки каждого пользователя по возрастанию (userRowStarts/userRows)
+    static void indexUserRows(const std::vector<std::uint32_t>& userIds, std::size_t userCount, Indexes& index) {
+        index.userRowStarts.assign(userCount + 1, 0);
+        for (std::uint32_t id : userIds) {
+            ++index.userRowStarts[id + 1];
+        }
+        std::partial_sum(index.userRowStarts.begin(), index.userRowStarts.end(), index.userRowStarts.begin());
+        index.userRows.resize(userIds.size());
+        std::vector<std::uint32_t> next(index.userRowStarts.begin(), index.userRowStarts.end() - 1);
+        for (std::uint32_t row = 0; row < userIds.size(); ++row) {
+            index.userRows[next[userIds[row]]++] = row;
+        }
+    }
+
+    // Пары (хэш ключа, строка) по возрастанию хэша (keyHashes/keyRows)
+    static void indexKeys(std::vector<std::pair<std::uint64_t, std::uint32_t>> keys, Indexes& index) {
+        std::sort(keys.begin(), keys.end());
+        index.keyHashes.reserve(keys.size());
+        index.keyRows.reserve(keys.size());
+        for (const auto& [hash, row] : keys) {
+            index.keyHashes.push_back(hash);
+            index.keyRows.push_back(row);
+        }
+    }
+
+    // Записывает столбцы и индексы в снимок (в header уже заданы границы сегмента).
+    // Тексты пишутся несжатыми.
+    void writeSnapshot(std::ostream& out, SnapshotSegmentHeader header) const {
+        std::vector<std::uint64_t> nameEnds;
+        std::string names;
+        for (std::uint32_t id = 0; id < users().size(); ++id) {
+            names.append(users().name(id));
+            nameEnds.push_back(names.size());
+        }
+
+        std::string content;
+        content.reserve(size() == 0 ? 0 : store.contentEndColumn().back());
+        ColumnarMessageStore::ContentReader reader(store);
+        for (std::size_t row = 0; row < size(); ++row) {
+            content.append(reader.read(row));
+        }
+
+        std::vector<std::uint32_t> partners;
+        std::vector<std::int64_t> spanFroms;
+        std::vector<std::int64_t> spanTos;
+        for (const Span& span : index.spans) {
+            partners.push_back(span.partner);
+            spanFroms.push_back(span.from);
+            spanTos.push_back(span.to);
+        }
+
+        header.rowCount = size();
+        header.userCount = users().size();
+        header.userNamesSize = names.size();
+        header.contentSize = content.size();
+        header.termCount = termCount();
+        header.termBytesSize = index.termBytes.size();
+        header.postingBytesSize = index.postingBytes.size();
+        header.spanCount = index.spans.size();
+
+        writeSnapshotSection(out, &header, 1);
+        writeSnapshotSection(out, nameEnds.data(), nameEnds.size());
+        writeSnapshotSection(out, names.data(), names.size());
+        writeSnapshotSection(out, store.timeColumn().data(), size());
+        writeSnapshotSection(out, store.userIdColumn().data(), size());
+        writeSnapshotSection(out, store.contentEndColumn().data(), size());
+        writeSnapshotSection(out, content.data(), content.size());
+        writeSnapshotSection(out, index.userRowStarts.data(), index.userRowStarts.size());
+        writeSnapshotSection(out, index.userRows.data(), index.userRows.size());
+        writeSnapshotSection(out, index.keyHashes.data(), index.keyHashes.size());
+        writeSnapshotSection(out, index.keyRows.data(), index.keyRows.size());
+        writeSnapshotSection(out, index.termEnds.data(), index.termEnds.size());
+        writeSnapshotSection(out, index.termBytes.data(), index.termBytes.size());
+        writeSnapshotSection(out, index.postingEnds.data(), index.postingEnds.size());
+        writeSnapshotSection(out, index.postingBytes.data(), index.postingBytes.size());
+        writeSnapshotSection(out, index.spanStarts.data(), index.spanStarts.size());
+        writeSnapshotSection(out, partners.data(), partners.size());
+        writeSnapshotSection(out, spanFroms.data(), spanFroms.size());
+        writeSnapshotSection(out, spanTos.data(), spanTos.size());
+    }
+
+    // Столбцы сегмента из снимка. Секции копируются как есть и проверяются
+    // одним проходом: индексы повреждённого снимка не укажут за пределы столбцов.
+    // Если задан contentCache, тексты сжимаются.
+    static std::shared_ptr<const SegmentColumns> readSnapshot(SnapshotReader& reader, const SnapshotSegmentHeader& header,
+                                                              std::size_t sketchCapacity,
+                                                              const std::shared_ptr<ContentBlockCache>& contentCache) {
+        const std::uint64_t rows = header.rowCount;
+        const std::uint64_t userCount = header.userCount;
+        const std::uint64_t maxCount = std::numeric_limits<std::uint32_t>::max();
+        if (rows == 0 || rows > maxCount || userCount > maxCount || header.spanCount > maxCount) {
+            throw std::runtime_error("Corrupted snapshot: bad segment header.");
+        }
+
+        const auto* nameEnds = reader.section<std::uint64_t>(userCount);
+        const auto* nameBytes = reader.section<char>(header.userNamesSize);
+        std::vector<std::string_view> names;
+        names.reserve(userCount);
+        std::uint64_t nameBegin = 0;
+        for (std::uint64_t id = 0; id < userCount; ++id) {
+            if (nameEnds[id] < nameBegin || nameEnds[id] > header.userNamesSize) {
+                throw std::runtime_error("Corrupted snapshot: bad user table.");
+            }
+            names.emplace_back(nameBytes + nameBegin, nameEnds[id] - nameBegin);
+            if (id > 0 && names[id - 1] >= names[id]) {
+                throw std::runtime_error("Corrupted snapshot: bad user table.");
+            }
+            nameBegin = nameEnds[id];
+        }
+        UserTable users(std::move(names)); // номер имени - его место в снимке
+
+        std::vector<std::int64_t> times = reader.column<std::int64_t>(rows);
+        std::vector<std::uint32_t> userIds = reader.column<std::uint32_t>(rows);
+        std::vector<std::uint64_t> contentEnds = reader.column<std::uint64_t>(rows);
+        const auto* contentBytes = reader.section<char>(header.contentSize);
+        for (std::uint64_t row = 0; row < rows; ++row) {
+            if (userIds[row] >= userCount || contentEnds[row] > header.contentSize ||
+                (row > 0 && (times[row] < times[row - 1] || contentEnds[row] < contentEnds[row - 1]))) {
+                throw std::runtime_error("Corrupted snapshot: bad message " + std::to_string(row) + ".");
+            }
+        }
+        std::string content(contentBytes, contentEnds.back());
+
+        Indexes index;
+        index.userRowStarts = reader.column<std::uint32_t>(userCount + 1);
+        index.userRows = reader.column<std::uint32_t>(rows);
+        if (index.userRowStarts[0] != 0 || index.userRowStarts[userCount] != rows) {
+            throw std::runtime_error("Corrupted snapshot: bad user index.");
+        }
+        for (std::uint32_t id = 0; id < userCount; ++id) {
+            const std::uint32_t begin = index.userRowStarts[id];
+            const std::uint32_t end = index.userRowStarts[id + 1];
+            if (end < begin || end > rows) {
+                throw std::runtime_error("Corrupted snapshot: bad user index.");
+            }
+            for (std::uint32_t i = begin; i < end; ++i) {
+                const std::uint32_t row = index.userRows[i];
+                if (row >= rows || userIds[row] != id || (i > begin && row <= index.userRows[i - 1])) {
+                    throw std::runtime_error("Corrupted snapshot: bad user index.");
+                }
+            }
+        }
+
+        index.keyHashes = reader.column<std::uint64_t>(rows);
+        index.keyRows = reader.column<std::uint32_t>(rows);
+        for (std::uint64_t i = 0; i < rows; ++i) {
+            if (index.keyRows[i] >= rows || (i > 0 && index.keyHashes[i] < index.keyHashes[i - 1])) {
+                throw std::runtime_error("Corrupted snapshot: bad key index.");
+            }
+        }
+
+        index.termEnds = reader.column<std::uint64_t>(header.termCount);
+        const auto* termBytes = reader.section<char>(header.termBytesSize);
+        index.termBytes.assign(termBytes, header.termBytesSize);
+        index.postingEnds = reader.column<std::uint64_t>(header.termCount);
+        index.postingBytes = reader.column<std::uint8_t>(header.postingBytesSize);
+        std::string_view previousTerm;
+        for (std::uint64_t i = 0; i < header.termCount; ++i) {
+            const std::uint64_t termBegin = i == 0 ? 0 : index.termEnds[i - 1];
+            const std::uint64_t postingBegin = i == 0 ? 0 : index.postingEnds[i - 1];
+            if (index.termEnds[i] < termBegin || index.termEnds[i] > header.termBytesSize ||
+                index.postingEnds[i] < postingBegin || index.postingEnds[i] > header.postingBytesSize) {
+                throw std::runtime_error("Corrupted snapshot: bad text index.");
+            }
+            std::string_view term = std::string_view(index.termBytes).substr(termBegin, index.termEnds[i] - termBegin);
+            if (i > 0 && previousTerm >= term) {
+                throw std::runtime_error("Corrupted snapshot: bad text index.");
+            }
+            previousTerm = term;
+            decodePostings({index.postingBytes.data() + postingBegin, static_cast<std::size_t>(index.postingEnds[i] - postingBegin)},
+                           rows);
+        }
+
+        index.spanStarts = reader.column<std::uint32_t>(userCount + 1);
+        const auto* partners = reader.section<std::uint32_t>(header.spanCount);
+        const auto* spanFroms = reader.section<std::int64_t>(header.spanCount);
+        const auto* spanTos = reader.section<std::int64_t>(header.spanCount);
+        if (index.spanStarts[0] != 0 || index.spanStarts[userCount] != header.spanCount) {
+            throw std::runtime_error("Corrupted snapshot: bad conversation index.");
+        }
+        index.spans.reserve(header.spanCount);
+        for (std::uint32_t id = 0; id < userCount; ++id) {
+            const std::uint32_t begin = index.spanStarts[id];
+            const std::uint32_t end = index.spanStarts[id + 1];
+            if (end < begin || end > header.spanCount) {
+                throw std::runtime_error("Corrupted snapshot: bad conversation index.");
+            }
+            for (std::uint32_t i = begin; i < end; ++i) {
+                const Span span{partners[i], spanFroms[i], spanTos[i]};
+                if (span.partner >= userCount || span.from > span.to ||
+                    (i > begin && std::tie(span.partner, span.from) < std::tie(index.spans.back().partner, index.spans.back().from))) {
+                    throw std::runtime_error("Corrupted snapshot: bad conversation index.");
+                }
+                index.spans.push_back(span);
+            }
+        }
+
+        ColumnarMessageStore store(std::move(users), std::move(times), std::move(userIds), std::move(contentEnds),
+                                   std::move(content));
+        if (contentCache) {
+            store.compressContent(contentCache);
+        }
+        return std::make_shared<const SegmentColumns>(std::move(store), std::move(index), sketchCapacity);
+    }
+
+    const ColumnarMessageStore& rows() const {
+        return store;
+    }
+
+    std::size_t size() const {
+        return store.size();
+    }
+
+    std::int64_t minTime() const {
+        return store.time(0);
+    }
+
+    std::int64_t maxTime() const {
+        return store.time(size() - 1);
+    }
+
+    MessagePtr message(std::size_t row) const {
+        ColumnarMessageStore::ContentReader reader(store);
+        return message(row, reader);
+    }
+
+    const HeavyHitterSketch& activitySketch() const {
+        return activity;
+    }
+
+    template<class Callback>
+    void forEachUserCount(Callback&& callback) const {
+        for (std::uint32_t id = 0; id < users().size(); ++id) {
+            if (std::uint64_t count = index.userRowStarts[id + 1] - index.userRowStarts[id]) {
+                callback(users().name(id), count);
+            }
+        }
+    }
+
+    std::size_t countFromUser(std::string_view username) const {
+        auto [begin, end] = rowsOfUser(username);
+        return static_cast<std::size_t>(end - begin);
+    }
+
+    MessagePtr find(std::string_view username, std::int64_t time, std::string_view content) const {
+        auto range = std::equal_range(index.keyHashes.begin(), index.keyHashes.end(), messageKeyHash(username, time, content));
+        ColumnarMessageStore::ContentReader reader(store);
+        for (auto it = range.first; it != range.second; ++it) {
+            const std::uint32_t row = index.keyRows[it - index.keyHashes.begin()];
+            if (store.time(row) == time && store.username(row) == username && reader.read(row) == content) {
+                return message(row, reader);
+            }
+        }
+        return nullptr;
+    }
+
+    template<class Callback>
+    void forEachInTimeRange(std::int64_t from, std::int64_t to, Callback&& callback) const {
+        auto [first, last] = store.rowsInTimeRange(from, to);
+        ColumnarMessageStore::ContentReader reader(store);
+        for (std::size_t row = first; row < last; ++row) {
+            callback(message(row, reader));
+        }
+    }
+
+    template<class Callback>
+    void forEachFromUserInTimeRange(std::string_view username, std::int64_t from, std::int64_t to, Callback&& callback) const {
+        auto [begin, end] = userRowsInTimeRange(username, from, to);
+        ColumnarMessageStore::ContentReader reader(store);
+        for (; begin != end; ++begin) {
+            callback(message(*begin, reader));
+        }
+    }
+
+    // Как MessageSegment::forEachMinuteCount: строки каждой минуты отсчитываются
+    // двоичным поиском конца минуты
+    template<class Callback>
+    void forEachMinuteCount(const std::string* username, std::int64_t from, std::int64_t to, Callback&& callback) const {
+        if (username) {
+            auto [begin, end] = userRowsInTimeRange(*username, from, to);
+            countByMinute(static_cast<std::size_t>(end - begin), [&, begin = begin](std::size_t i) {
+                return store.time(begin[i]);
+            }, callback);
+        } else {
+            auto [first, last] = store.rowsInTimeRange(from, to);
+            countByMinute(last - first, [&, first = first](std::size_t i) {
+                return store.time(first + i);
+            }, callback);
+        }
+    }
+
+    bool mayContainUser(std::string_view username) const {
+        return userFilter.mayContain(username);
+    }
+
+    bool mayContainTerms(const std::vector<std::string>& terms, TermMatch match) const {
+        return mayMatchTerms(termFilter, terms, match);
+    }
+
+    template<class Callback>
+    void forEachConversationSpan(std::string_view username, const std::string* partner,
+                                 std::int64_t from, std::int64_t to, Callback&& callback) const {
+        auto id = users().find(username);
+        if (!id) {
+            return;
+        }
+
+        const Span* begin = index.spans.data() + index.spanStarts[*id];
+        const Span* end = index.spans.data() + index.spanStarts[*id + 1];
+        if (partner) {
+            auto partnerId = users().find(*partner);
+            if (!partnerId) {
+                return;
+            }
+            // Промежутки одного собеседника не пересекаются, так что их концы тоже по возрастанию
+            end = std::upper_bound(begin, end, *partnerId, [](std::uint32_t value, const Span& span) {
+                return value < span.partner;
+            });
+            begin = std::lower_bound(begin, end, std::make_pair(*partnerId, from), [](const Span& span, const auto& key) {
+                return span.partner < key.first || (span.partner == key.first && span.to < key.second);
+            });
+        }
+        for (; begin != end; ++begin) {
+            if (begin->to >= from && begin->from <= to) {
+                callback(users().name(begin->partner), begin->from, begin->to);
+            }
+        }
+    }
+
+    // Дописывает в result найденные сообщения в порядке времени
+    void search(const std::vector<std::string>& terms, TermMatch match, const MessageFilter& filter,
+                std::vector<MessagePtr>& result) const {
+        std::optional<std::uint32_t> userId;
+        if (filter.username) {
+            userId = users().find(*filter.username);
+            if (!userId) {
+                return;
+            }
+        }
+
+        auto [first, last] = store.rowsInTimeRange(filter.startTime, filter.endTime);
+        auto lookup = [&](const std::string& term) {
+            return postingsOf(term);
+        };
+        ColumnarMessageStore::ContentReader reader(store);
+        for (std::uint32_t row : findPostings(terms, match, lookup, size())) {
+            if (row >= first && row < last && (!userId || store.userId(row) == *userId)) {
+                result.push_back(message(row, reader));
+            }
+        }
+    }
+
+    // Вызывает callback(слово, список строк) для каждого слова индекса
+    template<class Callback>
+    void forEachPostingList(Callback&& callback) const {
+        for (std::size_t i = 0; i < termCount(); ++i) {
+            callback(term(i), postings(i));
+        }
+    }
+
+    // Вызывает callback(пользователь, собеседник, начало, конец) для каждого промежутка бесед
+    template<class Callback>
+    void forEachSpan(Callback&& callback) const {
+        for (std::uint32_t id = 0; id < users().size(); ++id) {
+            for (std::uint32_t i = index.spanStarts[id]; i < index.spanStarts[id + 1]; ++i) {
+                const Span& span = index.spans[i];
+                callback(users().name(id), users().name(span.partner), span.from, span.to);
+            }
+        }
+    }
+
+private:
+    const UserTable& users() const {
+        return store.userTable();
+    }
+
+    // Текст сжатого хранилища указывает в распакованный блок, и ссылка держит его
+    MessagePtr message(std::size_t row, ColumnarMessageStore::ContentReader& reader) const {
+        const std::string_view content = reader.read(row);
+        return MessagePtr(Message(store.username(row), store.time(row), content), reader.currentBlock());
+    }
+
+    std::size_t termCount() const {
+        return index.termEnds.size();
+    }
+
+    std::string_view term(std::size_t i) const {
+        const std::uint64_t begin = i == 0 ? 0 : index.termEnds[i - 1];
+        return std::string_view(index.termBytes).substr(begin, index.termEnds[i] - begin);
+    }
+
+    EncodedPostings postings(std::size_t i) const {
+        const std::uint64_t begin = i == 0 ? 0 : index.postingEnds[i - 1];
+        return {index.postingBytes.data() + begin, static_cast<std::size_t>(index.postingEnds[i] - begin)};
+    }
+
+    EncodedPostings postingsOf(std::string_view word) const {
+        std::size_t low = 0;
+        std::size_t high = termCount();
+        while (low < high) {
+            const std::size_t middle = low + (high - low) / 2;
+            if (term(middle) < word) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        return low < termCount() && term(low) == word ? postings(low) : EncodedPostings{nullptr, 0};
+    }
+
+    std::pair<const std::uint32_t*, const std::uint32_t*> rowsOfUser(std::string_view username) const {
+        auto id = users().find(username);
+        if (!id) {
+            return {nullptr, nullptr};
+        }
+        const std::uint32_t* rows = index.userRows.data();
+        return {rows + index.userRowStarts[*id], rows + index.userRowStarts[*id + 1]};
+    }
+
+    std::pair<const std::uint32_t*, const std::uint32_t*> userRowsInTimeRange(std::string_view username,
+                                                                             std::int64_t from, std::int64_t to) const {
+        auto [begin, end] = rowsOfUser(username);
+        begin = std::lower_bound(begin, end, from, [&](std::uint32_t row, std::int64_t time) {
+            return store.time(row) < time;
+        });
+        end = std::upper_bound(begin, end, to, [&](std::int64_t time, std::uint32_t row) {
+            return time < store.time(row);
+        });
+        return {begin, end};
+    }
+
+    // Вызывает callback(начало минуты, число) по позициям 0..count с неубывающим временем timeAt(i)
+    template<class TimeAt, class Callback>
+    static void countByMinute(std::size_t count, TimeAt&& timeAt, Callback&& callback) {
+        std::size_t first = 0;
+        while (first < count) {
+            const std::int64_t minute = floorToMultiple(timeAt(first), millisecondsPerMinute);
+            std::size_t low = first + 1;
+            std::size_t high = count;
+            while (low < high) {
+                const std::size_t middle = low + (high - low) / 2;
+                if (withinGap(minute, timeAt(middle), millisecondsPerMinute - 1)) {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+            callback(minute, std::uint64_t(low - first));
+            first = low;
+        }
+    }
+
+    ColumnarMessageStore store;
+    Indexes index;
+    // Все имена таблицы (авторы и собеседники) и все слова текстового индекса
+    BloomFilter userFilter;
+    BloomFilter termFilter;
+    HeavyHitterSketch activity;
+};
+
+// Сегмент базы: сообщения промежутка времени от startTime до начала следующего
+// сегмента со всеми индексами. Сегмент не выходит за границу периода endTime,
+// поэтому старые сообщения удаляются целыми сегментами, без поиска каждого из
+// них в индексах.
+// Сегмент, в который больше не пишут, запечатывается (sealedCopy()): его
+// сообщения и индексы переносятся в плоские неизменяемые массивы
+// SegmentColumns. Запросы к запечатанному сегменту идут по ним, а изменять
+// можно только его изменяемую копию (mutableCopy()).
+class MessageSegment {
+public:
+    MessageSegment(std::int64_t startTime, std::int64_t endTime, std::size_t sketchCapacity = 0,
+                   std::int64_t conversationGap = 0)
+        : segmentStart(startTime), periodEnd(endTime), sketchCapacity(sketchCapacity), conversationGap(conversationGap),
+          arena(std::make_shared<MessageArena>()), activity(sketchCapacity) {}
+
+    std::int64_t startTime() const {
+        return segmentStart;
+    }
+
+    // Конец периода сегмента: первый момент, который в сегмент уже не попадёт
+    std::int64_t endTime() const {
+        return periodEnd;
+    }
+
+    bool sealed() const {
+        return columns != nullptr;
+    }
+
+    // Изменяемая копия запечатанного сегмента (или её копия): в такой сегмент
+    // пишут не по порядку времени
+    bool thawed() const {
+        return wasThawed;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    std::size_t size() const {
+        return columns ? columns->size() : messages.size();
+    }
+
+    // Время самого раннего и самого позднего сообщения (сегмент не пуст)
+    std::int64_t minTime() const {
+        return columns ? columns->minTime() : (*messages.begin())->time;
+    }
+
+    std::int64_t maxTime() const {
+        return columns ? columns->maxTime() : (*messages.rbegin())->time;
+    }
+
+    bool overlaps(std::int64_t from, std::int64_t to) const {
+        return !empty() && minTime() <= to && maxTime() >= from;
+    }
+
+    // Самое раннее и самое позднее сообщение (сегмент не пуст)
+    MessagePtr first() const {
+        return columns ? columns->message(0) : MessagePtr(*messages.begin());
+    }
+
+    MessagePtr last() const {
+        return columns ? columns->message(size() - 1) : MessagePtr(*messages.rbegin());
+    }
+
+    // Сообщение, только что добавленное в изменяемый сегмент, стало в нём первым (последним)
+    bool isFirst(const Message* message) const {
+        return *messages.begin() == message;
+    }
+
+    bool isLast(const Message* message) const {
+        return *messages.rbegin() == message;
+    }
+
+    // Запечатанная копия непустого изменяемого сегмента. Если все тексты лежат
+    // в памяти одного владельца (например, отображённого файла), столбцы
+    // ссылаются на них там, иначе тексты копируются подряд в один буфер, так
+    // что копия не держит память исходного сегмента. Если задан contentCache,
+    // тексты сжимаются блоками.
+    std::shared_ptr<MessageSegment> sealedCopy(const std::shared_ptr<ContentBlockCache>& contentCache = nullptr) const {
+        // Имена упорядочиваются один раз: номер имени в таблице - его место в этом порядке
+        std::vector<std::string_view> names;
+        names.reserve(messagesByUser.size());
+        for (const auto& entry : messagesByUser) {
+            names.push_back(entry.first);
+        }
+        for (const auto& [username, partners] : conversations) {
+            names.push_back(username);
+            for (const auto& entry : partners) {
+                names.push_back(entry.first);
+            }
+        }
+        std::sort(names.begin(), names.end());
+        names.erase(std::unique(names.begin(), names.end()), names.end());
+        std::unordered_map<std::string_view, std::uint32_t> userIdOf; // ключи - имена в арене
+        userIdOf.reserve(names.size());
+        for (std::uint32_t id = 0; id < names.size(); ++id) {
+            userIdOf.emplace(names[id], id);
+        }
+        UserTable users(std::move(names));
+
+        // Сообщения с равным временем стоят в индексе времени в порядке добавления,
+        // то есть номеров, поэтому строки - это живые номера, устойчиво упорядоченные
+        // по времени. Обычно сообщения добавлялись по порядку и не удалялись: тогда
+        // номер сообщения совпадает с номером строки
+        std::vector<std::uint32_t> idOfRow;
+        idOfRow.reserve(messages.size());
+        for (std::uint32_t id = 0; id < messagesById.size(); ++id) {
+            if (messagesById[id]) {
+                idOfRow.push_back(id);
+            }
+        }
+        auto earlier = [&](std::uint32_t a, std::uint32_t b) {
+            return messagesById[a]->time < messagesById[b]->time;
+        };
+        const bool idsAreRows = idOfRow.size() == messagesById.size() &&
+                                std::is_sorted(idOfRow.begin(), idOfRow.end(), earlier);
+        if (!idsAreRows) {
+            std::stable_sort(idOfRow.begin(), idOfRow.end(), earlier);
+        }
+        constexpr std::uint32_t noRow = std::numeric_limits<std::uint32_t>::max();
+        std::vector<std::uint32_t> rowById;
+        if (!idsAreRows) {
+            rowById.assign(messagesById.size(), noRow);
+            for (std::uint32_t row = 0; row < idOfRow.size(); ++row) {
+                rowById[idOfRow[row]] = row;
+            }
+        }
+
+        std::vector<std::int64_t> times;
+        std::vector<std::uint32_t> userIds;
+        std::vector<std::uint64_t> contentEnds;
+        const std::shared_ptr<const void> owner = arena->contentOwner();
+        std::vector<const char*> contentStarts;
+        std::string content;
+        std::uint64_t contentSize = 0;
+        times.reserve(idOfRow.size());
+        userIds.reserve(idOfRow.size());
+        contentEnds.reserve(idOfRow.size());
+        contentStarts.reserve(owner ? idOfRow.size() : 0);
+        for (std::uint32_t id : idOfRow) {
+            const Message* message = messagesById[id];
+            times.push_back(message->time);
+            userIds.push_back(userIdOf.find(message->username)->second);
+            if (owner) {
+                contentStarts.push_back(message->content.data());
+            } else {
+                content.append(message->content);
+            }
+            contentSize += message->content.size();
+            contentEnds.push_back(contentSize);
+        }
+
+        SegmentColumns::Indexes index;
+        SegmentColumns::indexUserRows(userIds, users.size(), index);
+
+        // Хэши ключей уже посчитаны в индексе messagesByKey
+        std::vector<std::pair<std::uint64_t, std::uint32_t>> keys;
+        keys.reserve(messagesByKey.size());
+        for (const auto& [hash, id] : messagesByKey) {
+            keys.emplace_back(hash, idsAreRows ? id : rowById[id]);
+        }
+        SegmentColumns::indexKeys(std::move(keys), index);
+
+        // Иначе списки текстового индекса переводятся из номеров сообщений
+        // в номера строк, а номера удалённых сообщений отбрасываются
+        std::vector<PostingList> remapped;
+        remapped.reserve(idsAreRows ? 0 : textIndex.termCount());
+        std::vector<std::pair<std::string_view, const PostingList*>> lists;
+        lists.reserve(textIndex.termCount());
+        textIndex.forEachPostingList([&](const std::string& term, const PostingList& list) {
+            if (idsAreRows) {
+                lists.emplace_back(term, &list);
+                return;
+            }
+            std::vector<std::uint32_t> rows;
+            for (std::uint32_t id : list.decode()) {
+                if (rowById[id] != noRow) {
+                    rows.push_back(rowById[id]);
+                }
+            }
+            if (rows.empty()) {
+                return;
+            }
+            std::sort(rows.begin(), rows.end()); // при вставках не по порядку номера и строки расходятся
+            PostingList& rowList = remapped.emplace_back();
+            for (std::uint32_t row : rows) {
+                rowList.add(row);
+            }
+            lists.emplace_back(term, &rowList);
+        });
+        std::sort(lists.begin(), lists.end(), [](const auto& a, const auto& b) {
+            return a.first < b.first;
+        });
+        for (const auto& [term, list] : lists) {
+            index.termBytes.append(term);
+            index.termEnds.push_back(index.termBytes.size());
+            index.postingBytes.insert(index.postingBytes.end(), list->encoded().begin(), list->encoded().end());
+            index.postingEnds.push_back(index.postingBytes.size());
+        }
+
+        index.spanStarts.assign(users.size() + 1, 0);
+        for (std::uint32_t id = 0; id < users.size(); ++id) {
+            const std::size_t first = index.spans.size();
+            auto userIt = conversations.find(users.name(id));
+            if (userIt != conversations.end()) {
+                for (const auto& [partner, spans] : userIt->second) {
+                    const std::uint32_t partnerId = *users.find(partner);
+                    for (const auto& [from, to] : spans) {
+                        index.spans.push_back({partnerId, from, to});
+                    }
+                }
+            }
+            std::sort(index.spans.begin() + first, index.spans.end(), [](const auto& a, const auto& b) {
+                return std::tie(a.partner, a.from) < std::tie(b.partner, b.from);
+            });
+            index.spanStarts[id + 1] = static_cast<std::uint32_t>(index.spans.size());
+        }
+
+        ColumnarMessageStore store = owner ? ColumnarMessageStore(std::move(users), std::move(times), std::move(userIds),
+                                                                  std::move(contentEnds), std::move(contentStarts), owner)
+                                           : ColumnarMessageStore(std::move(users), std::move(times), std::move(userIds),
+                                                                  std::move(contentEnds), std::move(content));
+        if (contentCache) {
+            store.compressContent(contentCache);
+        }
+        return fromColumns(segmentStart, periodEnd, sketchCapacity, conversationGap,
+                           std::make_shared<const SegmentColumns>(std::move(store), std::move(index), sketchCapacity));
+    }
+
+    // Запечатанный сегмент из подряд идущих запечатанных сегментов одного периода
+    static std::shared_ptr<MessageSegment> concatenate(const std::vector<const MessageSegment*>& parts,
+                                                       const std::shared_ptr<ContentBlockCache>& contentCache = nullptr) {
+        const MessageSegment& first = *parts.front();
+        std::vector<const SegmentColumns*> columns;
+        for (const MessageSegment* part : parts) {
+            columns.push_back(part->columns.get());
+        }
+        return fromColumns(first.segmentStart, first.periodEnd, first.sketchCapacity, first.conversationGap,
+                           SegmentColumns::concatenate(columns, first.sketchCapacity, first.conversationGap, contentCache));
+    }
+
+    // Записывает запечатанный сегмент в снимок
+    void writeSnapshot(std::ostream& out) const {
+        SnapshotSegmentHeader header{};
+        header.startTime = segmentStart;
+        header.periodEnd = periodEnd;
+        columns->writeSnapshot(out, header);
+    }
+
+    // Запечатанный сегмент из снимка; его сообщения должны лежать в границах сегмента
+    static std::shared_ptr<MessageSegment> readSnapshot(SnapshotReader& reader, std::size_t sketchCapacity,
+                                                        std::int64_t conversationGap,
+                                                        const std::shared_ptr<ContentBlockCache>& contentCache) {
+        const SnapshotSegmentHeader header = *reader.section<SnapshotSegmentHeader>(1);
+        auto columns = SegmentColumns::readSnapshot(reader, header, sketchCapacity, contentCache);
+        if (columns->minTime() < header.startTime || columns->maxTime() >= header.periodEnd) {
+            throw std::runtime_error("Corrupted snapshot: bad segment bounds.");
+        }
+        return fromColumns(header.startTime, header.periodEnd, sketchCapacity, conversationGap, std::move(columns));
+    }
+
+    // Изменяемая копия запечатанного сегмента. Индексы собираются заново по
+    // строкам (номер сообщения копии - номер строки, так что списки текстового
+    // индекса переносятся как есть). Несжатые тексты не копируются: копия
+    // держит их память.
+    std::shared_ptr<MessageSegment> mutableCopy() const {
+        auto copy = std::make_shared<MessageSegment>(segmentStart, periodEnd, sketchCapacity, conversationGap);
+        copy->wasThawed = true;
+        const ColumnarMessageStore& rows = columns->rows();
+        ColumnarMessageStore::ContentReader reader(rows);
+        // Сжатые тексты копируются в арену, несжатые остаются у своего владельца
+        const std::shared_ptr<const void>& owner = rows.contentOwner();
+        for (std::size_t row = 0; row < rows.size(); ++row) {
+            copy->insertRow(Message(rows.username(row), rows.time(row), reader.read(row)), owner, false);
+        }
+        columns->forEachPostingList([&](std::string_view term, EncodedPostings postings) {
+            PostingList list;
+            for (std::uint32_t row : decodePostings(postings)) {
+                list.add(row);
+            }
+            copy->textIndex.addPostingList(std::string(term), std::move(list));
+        });
+        columns->forEachSpan([&](std::string_view username, std::string_view partner, std::int64_t from, std::int64_t to) {
+            copy->addConversationSpan(copy->conversationsOf(copy->arena->intern(username))[copy->arena->intern(partner)],
+                                      from, to);
+        });
+        return copy;
+    }
+
+    // Изменение - только у изменяемого сегмента
+
+    // Размещает копию сообщения в арене сегмента (про owner - см. MessageArena::create)
+    const Message* add(const Message& message, const std::shared_ptr<const void>& owner = nullptr) {
+        const Message* msgPtr = arena->create(message, owner);
+        auto it = messages.insert(msgPtr);
+        UserMessages& user = userMessages(msgPtr->username);
+        user.messages.insert(msgPtr);
+        adjustMinuteCount(user.minuteCounts, msgPtr->time, 1);
+        registerMessage(msgPtr);
+        linkNeighbours(it);
+        return msgPtr;
+    }
+
+    // Вставка с подсказкой в конец индексов: O(1) для сообщения, которое не
+    // раньше уже добавленных, иначе как обычная вставка
+    const Message* insertSorted(const Message& message, const std::shared_ptr<const void>& owner = nullptr, bool indexText = true) {
+        auto it = insertRow(message, owner, indexText);
+        linkNeighbours(it);
+        return *it;
+    }
+
+    // Удаляет из всех индексов одно сообщение, совпадающее с ключом, и возвращает его
+    const Message* erase(const MessageKey& key) {
+        auto range = messagesByKey.equal_range(messageKeyHash(key.username, key.time, key.content));
+        for (auto it = range.first; it != range.second; ++it) {
+            const Message& msg = *messagesById[it->second];
+            if (msg.username == key.username && msg.time == key.time && msg.content == key.content) {
+                const Message* msgPtr = messagesById[it->second];
+                messagesById[it->second] = nullptr;
+                messagesByKey.erase(it);
+                eraseFromIndex(messages, msgPtr);
+                eraseFromUserIndex(msgPtr);
+                adjustMinuteCount(minuteCounts, msgPtr->time, -1);
+                activity.remove(msgPtr->username);
+                return msgPtr;
+            }
+        }
+        return nullptr;
+    }
+
+    // Память текстов сегмента: владелец всех текстов или арена. Сегменты,
+    // собранные из его сообщений (при делении), держат её вместо того, чтобы
+    // копировать тексты.
+    std::shared_ptr<const void> memory() const {
+        if (auto owner = arena->contentOwner()) {
+            return owner;
+        }
+        return arena;
+    }
+
+    // Переносит из other промежутки бесед, которые могут относиться к сообщениям
+    // этого сегмента (не дальше conversationGap от них)
+    void copyConversationSpans(const MessageSegment& other) {
+        if (messages.empty()) {
+            return;
+        }
+        const std::int64_t first = minTime();
+        const std::int64_t last = maxTime();
+        for (const auto& [username, partners] : other.conversations) {
+            for (const auto& [partner, spans] : partners) {
+                for (const auto& [from, to] : spans) {
+                    if ((to >= first || withinGap(to, first, conversationGap)) &&
+                        (from <= last || withinGap(last, from, conversationGap))) {
+                        addConversationSpan(conversationsOf(arena->intern(username))[arena->intern(partner)], from, to);
+                    }
+                }
+            }
+        }
+    }
+
+    // Связывает авторов соседних по времени сообщений earlier и later, если
+    // это разные пользователи и пауза не длиннее conversationGap. Одно из
+    // сообщений может быть из соседнего сегмента (так база связывает сообщения
+    // на границе сегментов): его автор тогда попадает в сегмент только как собеседник.
+    void linkConversation(const Message& earlier, const Message& later) {
+        if (conversationGap <= 0 || earlier.username == later.username ||
+            !withinGap(earlier.time, later.time, conversationGap)) {
+            return;
+        }
+        std::string_view first = arena->intern(earlier.username);
+        std::string_view second = arena->intern(later.username);
+        addConversationSpan(conversationsOf(first)[second], earlier.time, later.time);
+        addConversationSpan(conversationsOf(second)[first], earlier.time, later.time);
+    }
+
+    // Запросы - к сегменту любого вида
+
+    const HeavyHitterSketch& activitySketch() const {
+        return columns ? columns->activitySketch() : activity;
+    }
+
+    // Вызывает callback(имя, число сообщений) для каждого пользователя сегмента
+    template<class Callback>
+    void forEachUserCount(Callback&& callback) const {
+        if (columns) {
+            columns->forEachUserCount(callback);
+            return;
+        }
+        for (const auto& [username, user] : messagesByUser) {
+            callback(username, std::uint64_t(user.messages.size()));
+        }
+    }
+
+    bool containsUser(const std::string& username) const {
+        return countFromUser(username) > 0;
+    }
+
+    std::size_t countFromUser(const std::string& username) const {
+        if (columns) {
+            return columns->countFromUser(username);
+        }
+        auto userIt = messagesByUser.find(username);
+        return userIt == messagesByUser.end() ? 0 : userIt->second.messages.size();
+    }
+
+    // Удаляет все сообщения пользователя, возвращает их число
+    std::size_t removeUser(const std::string& username) {
+        auto userIt = messagesByUser.find(username);
+        if (userIt == messagesByUser.end()) {
+            return 0;
+        }
+
+        std::size_t removed = userIt->second.messages.size();
+        for (const auto& msg : userIt->second.messages) {
+            eraseFromIndex(messages, msg);
+            unregisterMessage(msg);
+            adjustMinuteCount(minuteCounts, msg->time, -1);
+        }
+        messagesByUser.erase(userIt);
+        conversations.erase(username);
+        activity.removeUser(username);
+        return removed;
+    }
+
+    MessagePtr find(std::string_view username, std::int64_t time, std::string_view content) const {
+        if (columns) {
+            return columns->find(username, time, content);
+        }
+        auto range = messagesByKey.equal_range(messageKeyHash(username, time, content));
+        for (auto it = range.first; it != range.second; ++it) {
+            const Message* msg = messagesById[it->second];
+            if (msg->username == username && msg->time == time && msg->content == content) {
+                return msg;
+            }
+        }
+        return nullptr;
+    }
+
+    template<class Callback>
+    void forEachInTimeRange(std::int64_t from, std::int64_t to, Callback&& callback) const {
+        if (columns) {
+            columns->forEachInTimeRange(from, to, callback);
+            return;
+        }
+        for (auto it = messages.lower_bound(from); it != messages.end() && (*it)->time <= to; ++it) {
+            callback(MessagePtr(*it));
+        }
+    }
+
+    template<class Callback>
+    void forEachFromUserInTimeRange(const std::string& username, std::int64_t from, std::int64_t to, Callback&& callback) const {
+        if (columns) {
+            columns->forEachFromUserInTimeRange(username, from, to, callback);
+            return;
+        }
+        auto userIt = messagesByUser.find(username);
+        if (userIt == messagesByUser.end()) {
+            return;
+        }
+
+        const TimeIndex& userMessages = userIt->second.messages;
+        for (auto it = userMessages.lower_bound(from); it != userMessages.end() && (*it)->time <= to; ++it) {
+            callback(MessagePtr(*it));
+        }
+    }
+
+    // Вызывает callback(начало минуты, число сообщений) для минут, в которые
+    // есть сообщения из [from, to] (пользователя username, если он задан).
+    // Полные минуты берутся из свёртки, неполные на краях диапазона
+    // досчитываются по индексу времени.
+    template<class Callback>
+    void forEachMinuteCount(const std::string* username, std::int64_t from, std::int64_t to, Callback&& callback) const {
+        if (columns) {
+            columns->forEachMinuteCount(username, from, to, callback);
+            return;
+        }
+        const MinuteCounts* counts = &minuteCounts;
+        if (username) {
+            auto userIt = messagesByUser.find(*username);
+            if (userIt == messagesByUser.end()) {
+                return;
+            }
+            counts = &userIt->second.minuteCounts;
+        }
+
+        auto it = counts->lower_bound(floorToMultiple(std::max(from, minTime()), millisecondsPerMinute));
+        for (; it != counts->end() && it->first <= to; ++it) {
+            const std::int64_t minuteEnd = it->first + millisecondsPerMinute - 1;
+            if (it->first >= from && minuteEnd <= to) {
+                callback(it->first, std::uint64_t(it->second));
+                continue;
+            }
+
+            std::uint64_t count = 0;
+            auto countOne = [&](const MessagePtr&) { ++count; };
+            if (username) {
+                forEachFromUserInTimeRange(*username, std::max(from, it->first), std::min(to, minuteEnd), countOne);
+            } else {
+                forEachInTimeRange(std::max(from, it->first), std::min(to, minuteEnd), countOne);
+            }
+            if (count > 0) {
+                callback(it->first, count);
+            }
+        }
+    }
+
+    // false - сообщений пользователя в сегменте точно нет (по фильтру Блума,
+    // не трогая индексов)
+    bool mayContainUser(std::string_view username) const {
+        return columns ? columns->mayContainUser(username) : userFilter.mayContain(username);
+    }
+
+    // false - в сегменте точно нет сообщений, подходящих под текстовый запрос
+    bool mayContainTerms(const std::vector<std::string>& terms, TermMatch match) const {
+        return columns ? columns->mayContainTerms(terms, match) : textIndex.mayMatch(terms, match);
+    }
+
+    // Вызывает callback(собеседник, начало, конец) для промежутков бесед
+    // пользователя (только с partner, если он задан), пересекающихся с [from, to]
+    template<class Callback>
+    void forEachConversationSpan(const std::string& username, const std::string* partner,
+                                 std::int64_t from, std::int64_t to, Callback&& callback) const {
+        if (columns) {
+            columns->forEachConversationSpan(username, partner, from, to, callback);
+            return;
+        }
+        auto userIt = conversations.find(username);
+        if (userIt == conversations.end()) {
+            return;
+        }
+
+        auto visit = [&](std::string_view partnerName, const ConversationSpans& spans) {
+            auto it = spans.upper_bound(from);
+            if (it != spans.begin() && std::prev(it)->second >= from) {
+                --it;
+            }
+            for (; it != spans.end() && it->first <= to; ++it) {
+                callback(partnerName, it->first, it->second);
+            }
+        };
+        const auto& partners = userIt->second;
+        if (partner) {
+            auto partnerIt = partners.find(*partner);
+            if (partnerIt != partners.end()) {
+                visit(partnerIt->first, partnerIt->second);
+            }
+        } else {
+            for (const auto& [partnerName, spans] : partners) {
+                visit(partnerName, spans);
+            }
+        }
+    }
+
+    // Дописывает в result найденные в сегменте сообщения в порядке времени
+    void search(const std::vector<std::string>& terms, TermMatch match, const MessageFilter& filter,
+                std::vector<MessagePtr>& result) const {
+        if (columns) {
+            columns->search(terms, match, filter, result);
+            return;
+        }
+        const std::size_t first = result.size();
+        for (std::uint32_t id : textIndex.find(terms, match)) {
+            const Message* msg = messagesById[id];
+            if (msg && msg->time >= filter.startTime && msg->time <= filter.endTime &&
+                (!filter.username || msg->username == *filter.username)) {
+                result.emplace_back(msg);
+            }
+        }
+        std::stable_sort(result.begin() + first, result.end(), MessageTimeLess());
+    }
+
+private:
+    using TimeIndex = std::multiset<const Message*, MessageTimeLess>;
+    using MinuteCounts = std::map<std::int64_t, std::uint32_t>;
+    // Непересекающиеся промежутки [начало, конец] бесед с одним собеседником
+    using ConversationSpans = std::map<std::int64_t, std::int64_t>;
+    // Собеседник -> промежутки, где их сообщения соседствовали
+    using PartnerSpans = std::unordered_map<std::string_view, ConversationSpans>;
+
+    struct UserMessages {
+        TimeIndex messages;
+        MinuteCounts minuteCounts;
+    };
+
+    // Запись пользователя во вторичном индексе; новый пользователь попадает в фильтр
+    UserMessages& userMessages(std::string_view username) {
+        auto [it, inserted] = messagesByUser.try_emplace(username);
+        if (inserted) {
+            addToUserFilter(username);
+        }
+        return it->second;
+    }
+
+    // Беседы пользователя; собеседник без сообщений в сегменте тоже попадает в фильтр
+    PartnerSpans& conversationsOf(std::string_view username) {
+        auto [it, inserted] = conversations.try_emplace(username);
+        if (inserted && messagesByUser.count(username) == 0) {
+            addToUserFilter(username);
+        }
+        return it->second;
+    }
+
+    // Переполненный фильтр строится заново по всем именам сегмента
+    void addToUserFilter(std::string_view username) {
+        if (!userFilter.full()) {
+            userFilter.add(username);
+            return;
+        }
+        userFilter = BloomFilter((messagesByUser.size() + conversations.size()) * 2);
+        for (const auto& entry : messagesByUser) {
+            userFilter.add(entry.first);
+        }
+        for (const auto& entry : conversations) {
+            userFilter.add(entry.first);
+        }
+    }
+
+    // Подсказка end() делает дешёвым обычный случай - сообщение в последней минуте
+    static void adjustMinuteCount(MinuteCounts& counts, std::int64_t time, int delta) {
+        auto it = counts.try_emplace(counts.end(), floorToMultiple(time, millisecondsPerMinute), 0);
+        it->second += delta;
+        if (it->second == 0) {
+            counts.erase(it);
+        }
+    }
+
+    // Вставка с подсказкой в конец индексов, без связывания собеседников;
+    // возвращает место сообщения в индексе времени
+    TimeIndex::iterator insertRow(const Message& message, const std::shared_ptr<const void>& owner, bool indexText) {
+        const Message* msgPtr = arena->create(message, owner);
+        auto it = messages.insert(messages.end(), msgPtr);
+        UserMessages& user = userMessages(msgPtr->username);
+        user.messages.insert(user.messages.end(), msgPtr);
+        adjustMinuteCount(user.minuteCounts, msgPtr->time, 1);
+        registerMessage(msgPtr, indexText);
+        return it;
+    }
+
+    // Удаляет из индекса именно этот объект (среди сообщений с тем же временем)
+    static void eraseFromIndex(TimeIndex& index, const Message* msgPtr) {
+        auto range = index.equal_range(msgPtr);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (*it == msgPtr) {
+                index.erase(it);
+                return;
+            }
+        }
+    }
+
+    // Выдаёт сообщению номер и добавляет его в хэш-индекс и текстовый индекс
+    void registerMessage(const Message* msgPtr, bool indexText = true) {
+        auto id = static_cast<std::uint32_t>(messagesById.size());
+        messagesById.push_back(msgPtr);
+        messagesByKey.emplace(messageKeyHash(*msgPtr), id);
+        if (indexText) {
+            textIndex.add(id, msgPtr->content);
+        }
+        adjustMinuteCount(minuteCounts, msgPtr->time, 1);
+        activity.add(msgPtr->username);
+    }
+
+    // Освобождает номер сообщения. В текстовом индексе номер остаётся
+    // и пропускается при поиске, так как ячейка становится пустой.
+    void unregisterMessage(const Message* msgPtr) {
+        auto range = messagesByKey.equal_range(messageKeyHash(*msgPtr));
+        for (auto it = range.first; it != range.second; ++it) {
+            if (messagesById[it->second] == msgPtr) {
+                messagesById[it->second] = nullptr;
+                messagesByKey.erase(it);
+                return;
+            }
+        }
+    }
+
+    // Сообщение связывает автора с авторами соседних по времени сообщений,
+    // если это другие пользователи и пауза не длиннее conversationGap.
+    // Удаление сообщений промежутки не сужает: беседы потом собираются
+    // по самим сообщениям, а промежутки лишь указывают, где их искать.
+    // Вставка между двумя сообщениями тоже не отменяет их связь, поэтому
+    // при добавлении не по порядку времени связей может быть больше.
+    void linkNeighbours(TimeIndex::iterator it) {
+        if (conversationGap <= 0) {
+            return;
+        }
+
+        if (it != messages.begin()) {
+            linkConversation(**std::prev(it), **it);
+        }
+        if (std::next(it) != messages.end()) {
+            linkConversation(**it, **std::next(it));
+        }
+    }
+
+    // Добавляет [from, to] и сливает его с пересекающимися промежутками
+    // и с промежутками ближе conversationGap
+    void addConversationSpan(ConversationSpans& spans, std::int64_t from, std::int64_t to) {
+        auto joins = [&](std::int64_t end, std::int64_t start) {
+            return start <= end || withinGap(end, start, conversationGap);
+        };
+        auto it = spans.upper_bound(from);
+        if (it != spans.begin() && joins(std::prev(it)->second, from)) {
+            --it;
+            from = it->first;
+            to = std::max(to, it->second);
+            it = spans.erase(it);
+        }
+        while (it != spans.end() && joins(to, it->first)) {
+            to = std::max(to, it->second);
+            it = spans.erase(it);
+        }
+        spans.emplace_hint(it, from, to);
+    }
+
+    // Запечатанный сегмент с готовыми столбцами
+    static std::shared_ptr<MessageSegment> fromColumns(std::int64_t startTime, std::int64_t endTime,
+                                                       std::size_t sketchCapacity, std::int64_t conversationGap,
+                                                       std::shared_ptr<const SegmentColumns> columns) {
+        auto segment = std::make_shared<MessageSegment>(startTime, endTime, sketchCapacity, conversationGap);
+        segment->arena.reset();
+        segment->columns = std::move(columns);
+        return segment;
+    }
+
+    void eraseFromUserIndex(const Message* msgPtr) {
+        auto userIt = messagesByUser.find(msgPtr->username);
+        if (userIt == messagesByUser.end()) {
+            return;
+        }
+
+        eraseFromIndex(userIt->second.messages, msgPtr);
+        adjustMinuteCount(userIt->second.minuteCounts, msgPtr->time, -1);
+        if (userIt->second.messages.empty()) {
+            messagesByUser.erase(userIt);
+        }
+    }
+
+    std::int64_t segmentStart;
+    std::int64_t periodEnd;
+    std::size_t sketchCapacity;
+    // Наибольшая пауза внутри беседы (0 - индекс бесед не ведётся)
+    std::int64_t conversationGap;
+    // Столбцы запечатанного сегмента; остальные поля у него пусты
+    std::shared_ptr<const SegmentColumns> columns;
+    bool wasThawed = false;
+    // Первичный индекс: сообщения в порядке времени (одинаковое время - в порядке добавления)
+    TimeIndex messages;
+    // Память сообщений, общая для всех копий сегмента
+    std::shared_ptr<MessageArena> arena;
+    // Вторичный индекс: сообщения каждого пользователя, тоже в порядке времени,
+    // и их поминутная свёртка. Имена указывают в арену.
+    std::unordered_map<std::string_view, UserMessages> messagesByUser;
+    // Промежутки бесед каждого пользователя (имена тоже в арене). Собеседник
+    // может быть автором сообщения из соседнего сегмента.
+    std::unordered_map<std::string_view, PartnerSpans> conversations;
+    // Все имена, когда-либо бывшие в messagesByUser или conversations: запрос
+    // по пользователю, которого здесь не было, пропускает сегмент без поиска в индексах
+    BloomFilter userFilter;
+    // Сообщения по номерам в порядке добавления, удалённые - пустые ячейки
+    std::vector<const Message*> messagesById;
+    // Хэш-индекс для точного поиска: хэш ключа -> номера сообщений с этим хэшем
+    std::unordered_multimap<std::uint64_t, std::uint32_t> messagesByKey;
+    // Полнотекстовый индекс по номерам сообщений
+    TextIndex textIndex;
+    // Свёртка: число сообщений сегмента за каждую минуту
+    MinuteCounts minuteCounts;
+    // Самые активные пользователи сегмента (если набросок включён)
+    HeavyHitterSketch activity;
+};
+
+// Согласованное неизменяемое состояние базы для чтения. Сегменты общие с базой:
+// писатель не меняет опубликованный сегмент, а изменяет его копию, поэтому
+// читатель может выполнять запросы к своему состоянию без блокировок,
+// пока база продолжает загружать сообщения.
+class DatabaseView {
+public:
+    DatabaseView(std::int64_t segmentSpan, std::size_t segmentCapacity, std::size_t sketchCapacity,
+                 std::int64_t conversationGap)
+        : segmentSpan(segmentSpan), segmentCapacity(segmentCapacity), sketchCapacity(sketchCapacity),
+          conversationGap(conversationGap) {}
+
+    // Номер публикации: растёт с каждой публикацией базы
+    std::uint64_t epoch() const {
+        return publishEpoch;
+    }
+
+    std::size_t segmentCount() const {
+        return segments.size();
+    }
+
+    // Сообщение с такими полями или nullptr
+    MessagePtr findMessage(const std::string& username, std::int64_t time, const std::string& content) const {
+        auto it = segmentFor(segments, time);
+        if (it == segments.end() || !it->second->mayContainUser(username)) {
+            return nullptr;
+        }
+        return it->second->find(username, time, content);
+    }
+
+    // Передаёт callback сообщения из [startTime, endTime] в порядке времени, не собирая их в память
+    template<class Callback>
+    void forEachMessageInTimeRange(std::int64_t startTime, std::int64_t endTime, Callback&& callback) const {
+        forEachSegmentInTimeRange(startTime, endTime, [&](const MessageSegment& segment) {
+            segment.forEachInTimeRange(startTime, endTime, callback);
+        });
+    }
+
+    template<class Callback>
+    void forEachMessageFromUserInTimeRange(const std::string& username, std::int64_t startTime, std::int64_t endTime,
+                                           Callback&& callback) const {
+        forEachSegmentInTimeRange(startTime, endTime, [&](const MessageSegment& segment) {
+            if (segment.mayContainUser(username)) {
+                segment.forEachFromUserInTimeRange(username, startTime, endTime, callback);
+            }
+        });
+    }
+
+    // Вывод результатов идёт через ResultSink: по умолчанию в stdout,
+    // либо в переданный приёмник (например, в файл для выгрузки)
+
+    void printAllMessagesFromUser(const std::string& username) const {
+        ResultSink sink;
+        printAllMessagesFromUser(username, sink);
+    }
+
+    void printAllMessagesFromUser(const std::string& username, ResultSink& sink) const {
+        printMessagesFromUserInTimeRange(username, std::numeric_limits<std::int64_t>::min(),
+                                         std::numeric_limits<std::int64_t>::max(), sink);
+    }
+
+    void printMessagesFromUserInTimeRange(const std::string& username, std::int64_t startTime, std::int64_t endTime) const {
+        ResultSink sink;
+        printMessagesFromUserInTimeRange(username, startTime, endTime, sink);
+    }
+
+    void printMessagesFromUserInTimeRange(const std::string& username, std::int64_t startTime, std::int64_t endTime,
+                                          ResultSink& sink) const {
+        forEachMessageFromUserInTimeRange(username, startTime, endTime, [&](MessagePtr message) {
+            sink.write(*message);
+        });
+    }
+
+    void printMessagesInTimeRange(std::int64_t startTime, std::int64_t endTime) const {
+        ResultSink sink;
+        printMessagesInTimeRange(startTime, endTime, sink);
+    }
+
+    void printMessagesInTimeRange(std::int64_t startTime, std::int64_t endTime, ResultSink& sink) const {
+        forEachMessageInTimeRange(startTime, endTime, [&](MessagePtr message) {
+            sink.write(*message);
+        });
+    }
+
+    // Сообщения, текст которых содержит все или хотя бы одно из слов terms,
+    // с учётом фильтра по пользователю и времени. Результат упорядочен по времени.
+    std::vector<MessagePtr> searchMessages(const std::vector<std::string>& terms, TermMatch match,
+                                           const MessageFilter& filter = MessageFilter()) const {
+        std::vector<MessagePtr> result;
+        forEachSegmentInTimeRange(filter.startTime, filter.endTime, [&](const MessageSegment& segment) {
+            if (segment.mayContainTerms(terms, match) && (!filter.username || segment.mayContainUser(*filter.username))) {
+                segment.search(terms, match, filter, result);
+            }
+        });
+        return result;
+    }
+
+    void printMessagesContaining(const std::vector<std::string>& terms, TermMatch match,
+                                 const MessageFilter& filter = MessageFilter()) const {
+        ResultSink sink;
+        printMessagesContaining(terms, match, filter, sink);
+    }
+
+    void printMessagesContaining(const std::vector<std::string>& terms, TermMatch match,
+                                 const MessageFilter& filter, ResultSink& sink) const {
+        for (const auto& message : searchMessages(terms, match, filter)) {
+            sink.write(*message);
+        }
+    }
+
+    // Число сообщений, подходящих под фильтр. Сегменты внутри диапазона
+    // считаются целиком, остальные - по поминутной свёртке.
+    std::uint64_t countMessages(const MessageFilter& filter = MessageFilter()) const {
+        const std::string* username = filter.username ? &*filter.username : nullptr;
+        std::uint64_t total = 0;
+        forEachSegmentInTimeRange(filter.startTime, filter.endTime, [&](const MessageSegment& segment) {
+            if (username && !segment.mayContainUser(*username)) {
+                return;
+            }
+            if (containsSegment(filter, segment)) {
+                total += messagesInSegment(filter, segment);
+                return;
+            }
+            segment.forEachMinuteCount(username, filter.startTime, filter.endTime, [&](std::int64_t, std::uint64_t count) {
+                total += count;
+            });
+        });
+        return total;
+    }
+
+    // Число подходящих под фильтр сообщений по промежуткам длины bucketSpan
+    // (кратной минуте, отсчёт от начала эпохи). Пустые промежутки пропускаются.
+    std::vector<CountBucket> countMessagesByBucket(std::int64_t bucketSpan, const MessageFilter& filter = MessageFilter()) const {
+        if (bucketSpan <= 0 || bucketSpan % millisecondsPerMinute != 0) {
+            throw std::invalid_argument("Bucket span must be a positive whole number of minutes.");
+        }
+
+        const std::string* username = filter.username ? &*filter.username : nullptr;
+        std::map<std::int64_t, std::uint64_t> counts;
+        forEachSegmentInTimeRange(filter.startTime, filter.endTime, [&](const MessageSegment& segment) {
+            if (username && !segment.mayContainUser(*username)) {
+                return;
+            }
+            const std::int64_t bucket = floorToMultiple(segment.minTime(), bucketSpan);
+            if (containsSegment(filter, segment) && bucket == floorToMultiple(segment.maxTime(), bucketSpan)) {
+                if (std::uint64_t count = messagesInSegment(filter, segment)) {
+                    counts[bucket] += count;
+                }
+                return;
+            }
+            segment.forEachMinuteCount(username, filter.startTime, filter.endTime, [&](std::int64_t minute, std::uint64_t count) {
+                counts[floorToMultiple(minute, bucketSpan)] += count;
+            });
+        });
+
+        std::vector<CountBucket> result;
+        result.reserve(counts.size());
+        for (const auto& [start, count] : counts) {
+            result.push_back({start, count});
+        }
+        return result;
+    }
+
+    // k самых активных пользователей за [startTime, endTime] по убыванию числа
+    // сообщений. Для сегментов внутри диапазона объединяются их наброски:
+    // count - оценка сверху, завышенная не больше чем на error. Без набросков
+    // и на краях диапазона сообщения считаются точно.
+    std::vector<HeavyHitterSketch::Counter> topUsers(std::size_t k,
+                                                     std::int64_t startTime = std::numeric_limits<std::int64_t>::min(),
+                                                     std::int64_t endTime = std::numeric_limits<std::int64_t>::max()) const {
+        struct Estimate {
+            std::uint64_t count = 0;
+            std::uint64_t error = 0;
+            std::uint64_t sketchedLimit = 0; // сумма absentLimit() набросков, в которых пользователь есть
+        };
+        // Имена указывают в сегменты этого состояния и живут вместе с ним
+        std::unordered_map<std::string_view, Estimate> estimates;
+        std::uint64_t totalLimit = 0;
+
+        forEachSegmentInTimeRange(startTime, endTime, [&](const MessageSegment& segment) {
+            const bool inside = segment.minTime() >= startTime && segment.maxTime() <= endTime;
+            const HeavyHitterSketch& sketch = segment.activitySketch();
+            if (inside && sketch.enabled()) {
+                totalLimit += sketch.absentLimit();
+                for (const auto& counter : sketch.counters()) {
+                    Estimate& estimate = estimates[counter.username];
+                    estimate.count += counter.count;
+                    estimate.error += counter.error;
+                    estimate.sketchedLimit += sketch.absentLimit();
+                }
+            } else if (inside) {
+                segment.forEachUserCount([&](std::string_view username, std::uint64_t count) {
+                    estimates[username].count += count;
+                });
+            } else {
+                segment.forEachInTimeRange(startTime, endTime, [&](const MessagePtr& message) {
+                    ++estimates[message->username].count;
+                });
+            }
+        });
+
+        std::vector<HeavyHitterSketch::Counter> result;
+        result.reserve(estimates.size());
+        for (const auto& [username, estimate] : estimates) {
+            // Там, где пользователя нет в наброске, у него могло быть до absentLimit() сообщений
+            const std::uint64_t unseen = totalLimit - estimate.sketchedLimit;
+            result.push_back({std::string(username), estimate.count + unseen, estimate.error + unseen});
+        }
+
+        auto byCount = [](const HeavyHitterSketch::Counter& a, const HeavyHitterSketch::Counter& b) {
+            return a.count != b.count ? a.count > b.count : a.username < b.username;
+        };
+        if (result.size() > k) {
+            std::partial_sort(result.begin(), result.begin() + k, result.end(), byCount);
+            result.resize(k);
+        } else {
+            std::sort(result.begin(), result.end(), byCount);
+        }
+        return result;
+    }
+
+    // Беседы пользователей a и b, в которых они обменивались сообщениями
+    // в [startTime, endTime], в порядке времени. Беседы возвращаются целиком,
+    // даже если выходят за диапазон. Пусто, если индекс бесед не ведётся.
+    std::vector<Conversation> conversationsBetween(const std::string& a, const std::string& b,
+                                                   std::int64_t startTime = std::numeric_limits<std::int64_t>::min(),
+                                                   std::int64_t endTime = std::numeric_limits<std::int64_t>::max()) const {
+        std::vector<Conversation> result;
+        if (conversationGap <= 0 || a == b) {
+            return result;
+        }
+
+        std::vector<std::pair<std::int64_t, std::int64_t>> spans;
+        forEachConversationSegment(startTime, endTime, [&](const MessageSegment& segment) {
+            if (!segment.mayContainUser(a) || !segment.mayContainUser(b)) {
+                return;
+            }
+            segment.forEachConversationSpan(a, &b, startTime, endTime, [&](std::string_view, std::int64_t from, std::int64_t to) {
+                spans.emplace_back(from, to);
+            });
+        });
+        std::sort(spans.begin(), spans.end());
+
+        const std::string& firstUser = std::min(a, b);
+        const std::string& secondUser = std::max(a, b);
+        std::int64_t coveredUntil = 0;
+        for (std::size_t i = 0; i < spans.size(); ++i) {
+            if (i > 0 && spans[i].first <= coveredUntil) {
+                continue; // промежуток внутри уже собранных бесед
+            }
+
+            // Промежуток расширяется до пауз длиннее conversationGap
+            auto [from, to] = conversationBounds(a, b, spans[i].first, spans[i].second);
+            coveredUntil = to;
+
+            std::vector<MessagePtr> firstMessages, secondMessages, merged;
+            forEachMessageFromUserInTimeRange(firstUser, from, to, [&](MessagePtr message) {
+                firstMessages.push_back(message);
+            });
+            forEachMessageFromUserInTimeRange(secondUser, from, to, [&](MessagePtr message) {
+                secondMessages.push_back(message);
+            });
+            std::merge(firstMessages.begin(), firstMessages.end(), secondMessages.begin(), secondMessages.end(),
+                       std::back_inserter(merged), MessageTimeLess());
+
+            // После удалений внутри промежутка могли появиться длинные паузы
+            std::size_t begin = 0;
+            for (std::size_t end = 1; end <= merged.size(); ++end) {
+                if (end < merged.size() && withinGap(merged[end - 1]->time, merged[end]->time, conversationGap)) {
+                    continue;
+                }
+
+                Conversation conversation{firstUser, secondUser, {merged.begin() + begin, merged.begin() + end}};
+                begin = end;
+                const std::string_view opener = conversation.messages.front()->username;
+                bool bothUsers = std::any_of(conversation.messages.begin(), conversation.messages.end(), [&](MessagePtr message) {
+                    return message->username != opener;
+                });
+                if (bothUsers && overlapsAny(spans, conversation.startTime(), conversation.endTime())) {
+                    result.push_back(std::move(conversation));
+                }
+            }
+        }
+        return result;
+    }
+
+    // Все беседы пользователя с обменом сообщениями в [startTime, endTime], по времени начала
+    std::vector<Conversation> conversationsOfUser(const std::string& username,
+                                                  std::int64_t startTime = std::numeric_limits<std::int64_t>::min(),
+                                                  std::int64_t endTime = std::numeric_limits<std::int64_t>::max()) const {
+        std::set<std::string> partners;
+        forEachConversationSegment(startTime, endTime, [&](const MessageSegment& segment) {
+            if (!segment.mayContainUser(username)) {
+                return;
+            }
+            segment.forEachConversationSpan(username, nullptr, startTime, endTime, [&](std::string_view partner, std::int64_t, std::int64_t) {
+                partners.emplace(partner);
+            });
+        });
+
+        std::vector<Conversation> result;
+        for (const auto& partner : partners) {
+            auto conversations = conversationsBetween(username, partner, startTime, endTime);
+            std::move(conversations.begin(), conversations.end(), std::back_inserter(result));
+        }
+        std::stable_sort(result.begin(), result.end(), [](const Conversation& x, const Conversation& y) {
+            return x.startTime() < y.startTime();
+        });
+        return result;
+    }
+
+private:
+    friend class MessageDatabase;
+
+    // Начало периода (промежутка длины segmentSpan), в который попадает время
+    std::int64_t periodStart(std::int64_t time) const {
+        return floorToMultiple(time, segmentSpan);
+    }
+
+    // Сегмент, в промежуток которого попадает время, или end(). Промежуток
+    // сегмента - от его начала до начала следующего, но не дальше конца периода.
+    template<class Segments>
+    static auto segmentFor(Segments& segments, std::int64_t time) -> decltype(segments.begin()) {
+        auto it = segments.upper_bound(time);
+        if (it == segments.begin()) {
+            return segments.end();
+        }
+        --it;
+        return it->second->endTime() > time ? it : segments.end();
+    }
+
+    // Сегмент целиком внутри диапазона фильтра: его сообщения можно считать по размеру индексов
+    static bool containsSegment(const MessageFilter& filter, const MessageSegment& segment) {
+        return segment.minTime() >= filter.startTime && segment.maxTime() <= filter.endTime;
+    }
+
+    static std::uint64_t messagesInSegment(const MessageFilter& filter, const MessageSegment& segment) {
+        return filter.username ? segment.countFromUser(*filter.username) : segment.size();
+    }
+
+    // Расширяет [from, to], пока в паузе conversationGap перед началом или после
+    // конца есть сообщения a или b
+    std::pair<std::int64_t, std::int64_t> conversationBounds(const std::string& a, const std::string& b,
+                                                             std::int64_t from, std::int64_t to) const {
+        const std::int64_t minTime = std::numeric_limits<std::int64_t>::min();
+        const std::int64_t maxTime = std::numeric_limits<std::int64_t>::max();
+        for (bool extended = true; extended;) {
+            extended = false;
+            std::int64_t earliest = from;
+            std::int64_t latest = to;
+            for (const std::string* username : {&a, &b}) {
+                if (from > minTime) {
+                    std::int64_t windowStart = from < minTime + conversationGap ? minTime : from - conversationGap;
+                    forEachMessageFromUserInTimeRange(*username, windowStart, from - 1, [&](MessagePtr message) {
+                        earliest = std::min(earliest, message->time);
+                    });
+                }
+                if (to < maxTime) {
+                    std::int64_t windowEnd = to > maxTime - conversationGap ? maxTime : to + conversationGap;
+                    forEachMessageFromUserInTimeRange(*username, to + 1, windowEnd, [&](MessagePtr message) {
+                        latest = std::max(latest, message->time);
+                    });
+                }
+            }
+            extended = earliest != from || latest != to;
+            from = earliest;
+            to = latest;
+        }
+        return {from, to};
+    }
+
+    static bool overlapsAny(const std::vector<std::pair<std::int64_t, std::int64_t>>& spans, std::int64_t from, std::int64_t to) {
+        return std::any_of(spans.begin(), spans.end(), [&](const auto& span) {
+            return span.second >= from && span.first <= to;
+        });
+    }
+
+    // Промежуток беседы на границе сегментов хранится в одном из двух соседних
+    // сегментов и может выходить за его сообщения не больше чем на conversationGap,
+    // поэтому сегменты с промежутками из [startTime, endTime] ищутся в расширенном диапазоне
+    template<class Callback>
+    void forEachConversationSegment(std::int64_t startTime, std::int64_t endTime, Callback&& callback) const {
+        const std::int64_t minTime = std::numeric_limits<std::int64_t>::min();
+        const std::int64_t maxTime = std::numeric_limits<std::int64_t>::max();
+        forEachSegmentInTimeRange(startTime < minTime + conversationGap ? minTime : startTime - conversationGap,
+                                  endTime > maxTime - conversationGap ? maxTime : endTime + conversationGap,
+                                  std::forward<Callback>(callback));
+    }
+
+    // Обходит по порядку сегменты, в которых есть сообщения из [startTime, endTime]
+    template<class Callback>
+    void forEachSegmentInTimeRange(std::int64_t startTime, std::int64_t endTime, Callback&& callback) const {
+        auto it = segments.upper_bound(startTime);
+        if (it != segments.begin()) {
+            --it; // startTime может попасть в предыдущий сегмент
+        }
+        for (; it != segments.end() && it->first <= endTime; ++it) {
+            if (it->second->overlaps(startTime, endTime)) {
+                callback(*it->second);
+            }
+        }
+    }
+
+    // Длина периода в миллисекундах: сегменты не выходят за границы периодов
+    std::int64_t segmentSpan;
+    // Примерное число сообщений, после которого начинается новый сегмент
+    std::size_t segmentCapacity;
+    // Размер наброска активных пользователей в каждом сегменте (0 - без наброска)
+    std::size_t sketchCapacity;
+    // Наибольшая пауза внутри беседы (0 - индекс бесед не ведётся)
+    std::int64_t conversationGap;
+    std::uint64_t publishEpoch = 0;
+    // Сегменты по времени начала
+    using SegmentMap = std::map<std::int64_t, std::shared_ptr<MessageSegment>>;
+    SegmentMap segments;
+};
+
+// База сообщений, разбитая на сегменты по времени. Сегмент лежит внутри одного
+// периода длины segmentSpan (по умолчанию - суток) и держит около segmentCapacity
+// сообщений: сообщение позже всех сообщений заполненного сегмента начинает
+// новый сегмент, а сегмент, выросший вдвое от вставок не по порядку времени,
+// делится пополам. Так копия опубликованного сегмента при изменении стоит
+// O(segmentCapacity), сколько бы сообщений ни было в периоде.
+// Если дописывать и публиковать понемногу (как LogFollower), новый сегмент
+// начинается уже после segmentCapacity / 16 сообщений опубликованного, чтобы
+// каждая публикация копировала только этот небольшой хвост. При публикации
+// подряд идущие маленькие сегменты периода снова собираются в один, когда
+// их набирается на segmentCapacity или период уже закончился.
+// Запросы по времени просматривают только сегменты, пересекающиеся с
+// диапазоном, а старые сообщения удаляются целыми периодами.
+// Если задан sketchCapacity, каждый сегмент ведёт набросок из стольких
+// счётчиков для быстрого приближённого topUsers(). Если задан conversationGap,
+// сегменты ведут индекс бесед: соседние по времени сообщения двух
+// пользователей с паузой не больше conversationGap относятся к их беседе.
+// Изменять базу и читать её напрямую может только один поток (писатель).
+// Другие потоки получают через view() последнее опубликованное состояние;
+// пакетные операции публикуют его сами, после addMessage и removeMessage
+// писатель вызывает publish(), когда изменения пора показать читателям.
+class MessageDatabase {
+public:
+    explicit MessageDatabase(std::int64_t segmentSpan = millisecondsPerDay, std::size_t sketchCapacity = 0,
+                             std::int64_t conversationGap = 0, std::size_t segmentCapacity = 4096)
+        : working(segmentSpan, segmentCapacity, sketchCapacity, conversationGap),
+          published(std::make_shared<const DatabaseView>(segmentSpan, segmentCapacity, sketchCapacity, conversationGap)) {
+        if (segmentSpan <= 0) {
+            throw std::invalid_argument("Segment span must be positive.");
+        }
+        if (segmentCapacity == 0) {
+            throw std::invalid_argument("Segment capacity must be positive.");
+        }
+        if (conversationGap < 0) {
+            throw std::invalid_argument("Conversation gap must not be negative.");
+        }
+    }
+
+    // Последнее опубликованное состояние. Можно вызывать из любого потока.
+    std::shared_ptr<const DatabaseView> view() const {
+        return std::atomic_load(&published);
+    }
+
+    // Показывает читателям текущее состояние. Сегменты не копируются: они
+    // копируются позже, при первом изменении уже опубликованного сегмента.
+    // Изменённые сегменты, кроме последнего (в него обычно продолжают писать),
+    // перед публикацией запечатываются. Размороженный для изменения сегмент
+    // запечатывается снова, только когда его перестают изменять: иначе
+    // каждая публикация между вставками в старый сегмент стоила бы
+    // разморозки и запечатывания целого сегмента.
+    void publish() {
+        sealSegments();
+        ++working.publishEpoch;
+        std::atomic_store(&published, std::make_shared<const DatabaseView>(working));
+    }
+
+    // Хранить тексты запечатанных сегментов сжатыми блоками (см.
+    // ColumnarMessageStore::compressContent). Распакованными в памяти остаются
+    // не больше cachedBlocks последних прочитанных блоков на всю базу, а запросы
+    // только по времени и пользователям сжатые тексты не читают. Действует на
+    // сегменты, запечатанные после вызова.
+    void setContentCompression(bool enabled, std::size_t cachedBlocks = 256) {
+        contentCache = enabled ? std::make_shared<ContentBlockCache>(cachedBlocks) : nullptr;
+    }
+
+    // Отбрасывать при добавлении точные копии имеющихся сообщений (то же имя,
+    // время и текст), например при повторной отправке журнала. Проверка идёт
+    // по хэш-индексу сегмента: в нём для каждого сообщения уже хранится
+    // 64-битный отпечаток ключа, так что отдельное множество ключей не нужно.
+    // Удалённое сообщение можно добавить снова.
+    void setDeduplication(bool enabled) {
+        deduplicate = enabled;
+    }
+
+    // Сколько сообщений отброшено как копии
+    std::uint64_t duplicateCount() const {
+        return duplicatesDropped;
+    }
+
+    // Копирует сообщение в базу. Если задан owner, текст не копируется,
+    // а база держит память owner, пока жив сегмент с этим сообщением.
+    // Возвращает false, если сообщение отброшено как копия.
+    bool addMessage(const Message& message, const std::shared_ptr<const void>& owner = nullptr) {
+        if (isDuplicate(message)) {
+            return false;
+        }
+        insertMessage(message, owner, false);
+        logMutation(JournalOperation::Add, message.username, message.time, message.content);
+        return true;
+    }
+
+    // Добавление пакета, уже отсортированного по времени. Вставка с подсказкой
+    // в конец индексов стоит амортизированно O(1), если пакет не раньше уже
+    // загруженных сообщений, иначе как обычная вставка. Возвращает число
+    // добавленных (без отброшенных копий).
+    std::size_t addSortedMessages(const std::vector<Message>& sorted, const std::shared_ptr<const void>& owner = nullptr) {
+        std::size_t added = 0;
+        for (const auto& message : sorted) {
+            if (isDuplicate(message)) {
+                continue;
+            }
+            insertMessage(message, owner, true);
+            logMutation(JournalOperation::Add, message.username, message.time, message.content);
+            ++added;
+        }
+        publish();
+        return added;
+    }
+
+    void removeMessage(const Message& message) {
+        if (!eraseMessage({message.username, message.time, message.content})) {
+            std::cerr << "Message not found for removal.\n";
+        }
+    }
+
+    // Удаляет по одному совпадающему сообщению на каждый ключ, возвращает число удалённых
+    std::size_t removeMessages(const std::vector<MessageKey>& keys) {
+        std::size_t removed = 0;
+        for (const auto& key : keys) {
+            removed += eraseMessage(key);
+        }
+        publish();
+        return removed;
+    }
+
+    void removeAllMessagesFromUser(const std::string& username) {
+        eraseUser(username);
+        publish();
+    }
+
+    // Удаляет сегменты всех периодов, которые целиком раньше time, и возвращает
+    // число удалённых сообщений. Период, содержащий time, остаётся целиком.
+    std::size_t dropSegmentsBefore(std::int64_t time) {
+        std::size_t removed = eraseSegmentsBefore(time);
+        publish();
+        return removed;
+    }
+
+    // Запросы писателя видят все его изменения, в том числе не опубликованные
+
+    std::size_t segmentCount() const {
+        return working.segmentCount();
+    }
+
+    MessagePtr findMessage(const std::string& username, std::int64_t time, const std::string& content) const {
+        return working.findMessage(username, time, content);
+    }
+
+    template<class Callback>
+    void forEachMessageInTimeRange(std::int64_t startTime, std::int64_t endTime, Callback&& callback) const {
+        working.forEachMessageInTimeRange(startTime, endTime, std::forward<Callback>(callback));
+    }
+
+    template<class Callback>
+    void forEachMessageFromUserInTimeRange(const std::string& username, std::int64_t startTime, std::int64_t endTime,
+                                           Callback&& callback) const {
+        working.forEachMessageFromUserInTimeRange(username, startTime, endTime, std::forward<Callback>(callback));
+    }
+
+    void printAllMessagesFromUser(const std::string& username) const {
+        working.printAllMessagesFromUser(username);
+    }
+
+    void printAllMessagesFromUser(const std::string& username, ResultSink& sink) const {
+        working.printAllMessagesFromUser(username, sink);
+    }
+
+    void printMessagesFromUserInTimeRange(const std::string& username, std::int64_t startTime, std::int64_t endTime) const {
+        working.printMessagesFromUserInTimeRange(username, startTime, endTime);
+    }
+
+    void printMessagesFromUserInTimeRange(const std::string& username, std::int64_t startTime, std::int64_t endTime,
+                                          ResultSink& sink) const {
+        working.printMessagesFromUserInTimeRange(username, startTime, endTime, sink);
+    }
+
+    void printMessagesInTimeRange(std::int64_t startTime, std::int64_t endTime) const {
+        working.printMessagesInTimeRange(startTime, endTime);
+    }
+
+    void printMessagesInTimeRange(std::int64_t startTime, std::int64_t endTime, ResultSink& sink) const {
+        working.printMessagesInTimeRange(startTime, endTime, sink);
+    }
+
+    std::vector<MessagePtr> searchMessages(const std::vector<std::string>& terms, TermMatch match,
+                                           const MessageFilter& filter = MessageFilter()) const {
+        return working.searchMessages(terms, match, filter);
+    }
+
+    void printMessagesContaining(const std::vector<std::string>& terms, TermMatch match,
+                                 const MessageFilter& filter = MessageFilter()) const {
+        working.printMessagesContaining(terms, match, filter);
+    }
+
+    void printMessagesContaining(const std::vector<std::string>& terms, TermMatch match,
+                                 const MessageFilter& filter, ResultSink& sink) const {
+        working.printMessagesContaining(terms, match, filter, sink);
+    }
+
+    std::uint64_t countMessages(const MessageFilter& filter = MessageFilter()) const {
+        return working.countMessages(filter);
+    }
+
+    std::vector<CountBucket> countMessagesByBucket(std::int64_t bucketSpan, const MessageFilter& filter = MessageFilter()) const {
+        return working.countMessagesByBucket(bucketSpan, filter);
+    }
+
+    std::vector<HeavyHitterSketch::Counter> topUsers(std::size_t k,
+                                                     std::int64_t startTime = std::numeric_limits<std::int64_t>::min(),
+                                                     std::int64_t endTime = std::numeric_limits<std::int64_t>::max()) const {
+        return working.topUsers(k, startTime, endTime);
+    }
+
+    std::vector<Conversation> conversationsBetween(const std::string& a, const std::string& b,
+                                                   std::int64_t startTime = std::numeric_limits<std::int64_t>::min(),
+                                                   std::int64_t endTime = std::numeric_limits<std::int64_t>::max()) const {
+        return working.conversationsBetween(a, b, startTime, endTime);
+    }
+
+    std::vector<Conversation> conversationsOfUser(const std::string& username,
+                                                  std::int64_t startTime = std::numeric_limits<std::int64_t>::min(),
+                                                  std::int64_t endTime = std::numeric_limits<std::int64_t>::max()) const {
+        return working.conversationsOfUser(username, startTime, endTime);
+    }
+
+    // Записывает снимок базы. Файл пишется под временным именем, сбрасывается
+    // на диск и затем переименовывается, так что прерванная запись не портит
+    // прежний снимок. Снимку даётся следующее поколение журнала, и журнал
+    // начинается заново только после того, как переименование тоже попало на
+    // диск: если сбой случится раньше, старый журнал при открытии будет пропущен
+    // (новый снимок уже на месте) или повторён поверх старого снимка.
+    void saveSnapshot(const std::string& filename) {
+        commitJournal();
+        // Сегмент, в который ещё пишут, записывается запечатанной копией
+        std::vector<std::shared_ptr<const MessageSegment>> segments;
+        for (const auto& [start, segment] : working.segments) {
+            if (!segment->empty()) {
+                segments.push_back(segment->sealed() ? segment : segment->sealedCopy());
+            }
+        }
+
+        SnapshotHeader header{};
+        std::copy(std::begin(snapshotMagic), std::end(snapshotMagic), header.magic);
+        header.version = snapshotVersion;
+        header.journalGeneration = journalGeneration + 1;
+        header.segmentSpan = working.segmentSpan;
+        header.conversationGap = working.conversationGap;
+        header.segmentCount = segments.size();
+
+        const std::string tempFilename = filename + ".tmp";
+        std::ofstream out(tempFilename, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) {
+            throw std::runtime_error("Could not create file: " + tempFilename);
+        }
+
+        writeSnapshotSection(out, &header, 1);
+        for (const auto& segment : segments) {
+            segment->writeSnapshot(out);
+        }
+
+        out.close();
+        if (out.fail()) {
+            throw std::runtime_error("Could not write file: " + tempFilename);
+        }
+        syncFile(tempFilename);
+        if (std::rename(tempFilename.c_str(), filename.c_str()) != 0) {
+            throw std::runtime_error("Could not rename " + tempFilename + " to " + filename);
+        }
+        syncDirectoryOf(filename);
+
+        journalGeneration = header.journalGeneration;
+        if (journal) {
+            journal->restart(journalGeneration);
+        }
+    }
+
+    // Загружает снимок в пустую базу: сегменты собираются прямо из столбцов
+    // и индексов снимка, без разбора текстов и перестройки индексов. Снимок
+    // должен быть записан базой с теми же segmentSpan и conversationGap.
+    void loadSnapshot(const std::string& filename) {
+        if (!working.segments.empty() || journal) {
+            throw std::runtime_error("Snapshot can only be loaded into an empty database before its journal is opened.");
+        }
+
+        MappedFile file(filename);
+        SnapshotReader reader(file.view());
+
+        const SnapshotHeader header = *reader.section<SnapshotHeader>(1);
+        if (!std::equal(std::begin(snapshotMagic), std::end(snapshotMagic), header.magic)) {
+            throw std::runtime_error("Not a snapshot file: " + filename);
+        }
+        if (header.version != snapshotVersion) {
+            throw std::runtime_error("Unsupported snapshot version " + std::to_string(header.version) + ": " + filename);
+        }
+        if (header.segmentSpan != working.segmentSpan || header.conversationGap != working.conversationGap) {
+            throw std::runtime_error("Snapshot was saved with another segment span or conversation gap: " + filename);
+        }
+
+        DatabaseView::SegmentMap segments;
+        for (std::uint64_t i = 0; i < header.segmentCount; ++i) {
+            auto segment = MessageSegment::readSnapshot(reader, working.sketchCapacity, working.conversationGap, contentCache);
+            // Сегмент лежит внутри своего периода (его начало не раньше начала
+            // периода, а сообщения проверены по границам сегмента) и после предыдущего
+            const std::int64_t periodEnd = segment->endTime();
+            if (periodEnd % working.segmentSpan != 0 ||
+                std::uint64_t(periodEnd) - std::uint64_t(segment->startTime()) > std::uint64_t(working.segmentSpan) ||
+                (!segments.empty() && segments.rbegin()->second->maxTime() >= segment->startTime())) {
+                throw std::runtime_error("Corrupted snapshot: bad segment bounds.");
+            }
+            segments.emplace_hint(segments.end(), segment->startTime(), std::move(segment));
+        }
+
+        working.segments = std::move(segments);
+        journalGeneration = header.journalGeneration;
+        publish();
+    }
+
+    // Повторяет изменения из журнала поверх текущего содержимого базы
+    // (обычно только что загруженного снимка) и дальше записывает в него
+    // все изменения. Без commitJournal() они попадают на диск группами.
+    void openJournal(const std::string& filename, std::size_t groupSize = 1024) {
+        journal.reset();
+        MutationJournal::replay(filename, journalGeneration, [&](JournalOperation operation, std::string_view username,
+                                              std::int64_t time, std::string_view content) {
+            switch (operation) {
+                case JournalOperation::Add:
+                    addMessage(Message(username, time, content));
+                    break;
+                case JournalOperation::Remove:
+                    eraseMessage({username, time, content});
+                    break;
+                case JournalOperation::RemoveUser:
+                    eraseUser(std::string(username));
+                    break;
+                case JournalOperation::DropBefore:
+                    eraseSegmentsBefore(time);
+                    break;
+                default:
+                    throw std::runtime_error("Unknown journal operation in " + filename);
+            }
+        });
+        publish();
+        journal = std::make_unique<MutationJournal>(filename, journalGeneration, groupSize);
+    }
+
+    void commitJournal() {
+        if (journal) {
+            journal->commit();
+        }
+    }
+
+    // Восстановление после перезапуска: последний снимок (если он есть) и журнал поверх него
+    void open(const std::string& snapshotFilename, const std::string& journalFilename) {
+        if (std::ifstream(snapshotFilename).is_open()) {
+            loadSnapshot(snapshotFilename);
+        }
+        openJournal(journalFilename);
+    }
+
+private:
+    // Сегмент для изменения. Запечатанный сегмент заменяется изменяемой копией.
+    // Опубликованный сегмент могут читать другие потоки, поэтому вместо него
+    // тоже изменяется его копия.
+    MessageSegment& writableSegment(DatabaseView::SegmentMap::iterator it) {
+        if (it->second->sealed()) {
+            it->second = it->second->mutableCopy();
+        } else if (isPublished(it)) {
+            it->second = std::make_shared<MessageSegment>(*it->second);
+        }
+        writtenSegments.insert(it->second.get());
+        return *it->second;
+    }
+
+    // Сегмент для сообщения со временем time. Новый сегмент начинается в начале
+    // периода, если в периоде нет сегмента, начавшегося не позже time, или
+    // в самом time, если сообщение позже всех сообщений заполненного сегмента.
+    DatabaseView::SegmentMap::iterator segmentAt(std::int64_t time) {
+        auto& segments = working.segments;
+        auto it = DatabaseView::segmentFor(segments, time);
+        if (it == segments.end()) {
+            return createSegment(working.periodStart(time));
+        }
+        const MessageSegment& segment = *it->second;
+        if (time > segment.maxTime() &&
+            (segment.size() >= working.segmentCapacity ||
+             (segment.size() >= tailCapacity() && (segment.sealed() || isPublished(it))))) {
+            return createSegment(time);
+        }
+        return it;
+    }
+
+    // Сколько сообщений набирает опубликованный сегмент, прежде чем
+    // дописываемые после него сообщения начнут новый
+    std::size_t tailCapacity() const {
+        return std::max<std::size_t>(working.segmentCapacity / 16, 1);
+    }
+
+    bool isPublished(DatabaseView::SegmentMap::const_iterator it) const {
+        auto publishedIt = published->segments.find(it->first);
+        return publishedIt != published->segments.end() && publishedIt->second == it->second;
+    }
+
+    DatabaseView::SegmentMap::iterator createSegment(std::int64_t start) {
+        auto segment = std::make_shared<MessageSegment>(start, working.periodStart(start) + working.segmentSpan,
+                                                        working.sketchCapacity, working.conversationGap);
+        return working.segments.emplace(start, std::move(segment)).first;
+    }
+
+    void sealSegments() {
+        auto& segments = working.segments;
+        const auto last = std::prev(segments.end(), segments.empty() ? 0 : 1);
+        for (auto it = segments.begin(); it != last; ++it) {
+            const MessageSegment& segment = *it->second;
+            if (!segment.sealed() && !(segment.thawed() && writtenSegments.count(&segment))) {
+                it->second = segment.sealedCopy(contentCache);
+            }
+        }
+        writtenSegments.clear();
+
+        auto small = [&](DatabaseView::SegmentMap::iterator it) {
+            return it->second->sealed() && it->second->size() < working.segmentCapacity / 2;
+        };
+        for (auto it = segments.begin(); it != last; ++it) {
+            if (!small(it)) {
+                continue;
+            }
+            const std::int64_t periodEnd = it->second->endTime();
+            std::vector<const MessageSegment*> run;
+            std::size_t total = 0;
+            auto runEnd = it;
+            for (; runEnd != last && total < working.segmentCapacity && runEnd->first < periodEnd && small(runEnd);
+                 ++runEnd) {
+                run.push_back(runEnd->second.get());
+                total += runEnd->second->size();
+            }
+            if (run.size() > 1 && (total >= working.segmentCapacity || runEnd->first >= periodEnd)) {
+                it->second = MessageSegment::concatenate(run, contentCache);
+                segments.erase(std::next(it), runEnd);
+            }
+        }
+    }
+
+    // Вставляет сообщение в его сегмент (sorted - не раньше сообщений сегмента).
+    // После деления сегмента копия сообщения может жить уже в другой арене,
+    // поэтому указатель на неё не возвращается.
+    void insertMessage(const Message& message, const std::shared_ptr<const void>& owner, bool sorted) {
+        auto it = segmentAt(message.time);
+        MessageSegment& segment = writableSegment(it);
+        const Message* msgPtr = sorted ? segment.insertSorted(message, owner) : segment.add(message, owner);
+        linkAcrossSegments(it, msgPtr);
+        if (segment.size() > 2 * working.segmentCapacity) {
+            splitSegment(it);
+        }
+    }
+
+    // Делит сегмент пополам по времени (сообщения с одинаковым временем остаются
+    // вместе). Половины собираются заново из тех же сообщений: тексты не
+    // копируются, половины держат память исходного сегмента.
+    void splitSegment(DatabaseView::SegmentMap::iterator it) {
+        std::shared_ptr<MessageSegment> segment = it->second;
+        std::vector<MessagePtr> messages;
+        messages.reserve(segment->size());
+        segment->forEachInTimeRange(segment->minTime(), segment->maxTime(), [&](MessagePtr msgPtr) {
+            messages.push_back(msgPtr);
+        });
+
+        auto middle = std::lower_bound(messages.begin(), messages.end(), messages[messages.size() / 2]->time,
+                                       MessageTimeLess());
+        if (middle == messages.begin()) {
+            middle = std::upper_bound(messages.begin(), messages.end(), messages.front()->time, MessageTimeLess());
+            if (middle == messages.end()) {
+                return; // у всех сообщений одно время
+            }
+        }
+
+        const std::int64_t splitTime = (*middle)->time;
+        auto first = std::make_shared<MessageSegment>(segment->startTime(), segment->endTime(), working.sketchCapacity,
+                                                      working.conversationGap);
+        auto second = std::make_shared<MessageSegment>(splitTime, segment->endTime(), working.sketchCapacity,
+                                                       working.conversationGap);
+        const std::shared_ptr<const void> memory = segment->memory();
+        for (MessagePtr msgPtr : messages) {
+            (msgPtr->time < splitTime ? first : second)->insertSorted(*msgPtr, memory);
+        }
+        first->copyConversationSpans(*segment);
+        second->copyConversationSpans(*segment);
+
+        it->second = std::move(first);
+        working.segments.emplace_hint(std::next(it), splitTime, std::move(second));
+    }
+
+    // Сообщение, ставшее первым (последним) в сегменте, соседствует с последним
+    // (первым) сообщением предыдущего (следующего) сегмента. Промежуток беседы
+    // запоминает сегмент нового сообщения, так что соседний сегмент не копируется.
+    void linkAcrossSegments(DatabaseView::SegmentMap::iterator it, const Message* msgPtr) {
+        if (working.conversationGap <= 0) {
+            return;
+        }
+        MessageSegment& segment = *it->second;
+        if (it != working.segments.begin() && segment.isFirst(msgPtr)) {
+            segment.linkConversation(*std::prev(it)->second->last(), *msgPtr);
+        }
+        auto next = std::next(it);
+        if (next != working.segments.end() && segment.isLast(msgPtr)) {
+            segment.linkConversation(*msgPtr, *next->second->first());
+        }
+    }
+
+    void logMutation(JournalOperation operation, std::string_view username, std::int64_t time, std::string_view content) {
+        if (journal) {
+            journal->append(operation, username, time, content);
+        }
+    }
+
+    // Удаляет одно сообщение, совпадающее с ключом, и пустой после этого сегмент
+    bool eraseMessage(const MessageKey& key) {
+        auto it = DatabaseView::segmentFor(working.segments, key.time);
+        if (it == working.segments.end() || !it->second->find(key.username, key.time, key.content)) {
+            return false;
+        }
+
+        const Message* msgPtr = writableSegment(it).erase(key);
+        logMutation(JournalOperation::Remove, msgPtr->username, msgPtr->time, msgPtr->content);
+        if (it->second->empty()) {
+            working.segments.erase(it);
+        }
+        return true;
+    }
+
+    std::size_t eraseUser(const std::string& username) {
+        std::size_t removed = 0;
+        auto& segments = working.segments;
+        for (auto it = segments.begin(); it != segments.end();) {
+            if (it->second->containsUser(username)) {
+                removed += writableSegment(it).removeUser(username);
+            }
+            it = it->second->empty() ? segments.erase(it) : std::next(it);
+        }
+        if (removed > 0) {
+            logMutation(JournalOperation::RemoveUser, username, 0, {});
+        }
+        return removed;
+    }
+
+    // Копия уже есть в базе (если дедупликация включена). Проверка не
+    // копирует опубликованный сегмент, так что копии его не трогают.
+    bool isDuplicate(const Message& message) {
+        if (!deduplicate) {
+            return false;
+        }
+        auto it = DatabaseView::segmentFor(working.segments, message.time);
+        if (it == working.segments.end() || !it->second->find(message.username, message.time, message.content)) {
+            return false;
+        }
+        ++duplicatesDropped;
+        return true;
+    }
+
+    std::size_t eraseSegmentsBefore(std::int64_t time) {
+        std::size_t removed = 0;
+        auto& segments = working.segments;
+        auto it = segments.begin();
+        while (it != segments.end() && it->second->endTime() <= time) {
+            removed += it->second->size();
+            it = segments.erase(it);
+        }
+        if (removed > 0) {
+            logMutation(JournalOperation::DropBefore, {}, time, {});
+        }
+        return removed;
+    }
+
+    // Состояние, которое изменяет писатель
+    DatabaseView working;
+    // Сегменты, изменённые после последней публикации
+    std::unordered_set<const MessageSegment*> writtenSegments;
+    // Кэш распакованных текстов, если тексты сжимаются
+    std::shared_ptr<ContentBlockCache> contentCache;
+    // Последнее опубликованное состояние (читается и заменяется атомарно)
+    std::shared_ptr<const DatabaseView> published;
+    // Журнал изменений, если он открыт, и его поколение
+    std::unique_ptr<MutationJournal> journal;
+    std::uint32_t journalGeneration = 0;
+    bool deduplicate = false;
+    std::uint64_t duplicatesDropped = 0;
+};
+
+// Поля строки журнала. Строки указывают внутрь разобранной строки.
+struct MessageFields {
+    std::string_view username;
+    std::int64_t time;
+    std::string_view content;
+};
+
+inline bool isSpace(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Результат разбора строки журнала
+enum class ParseStatus {
+    Ok,
+    MissingField,     // нет имени, даты или времени
+    InvalidTimestamp, // дата или время в неверном формате
+};
+
+const char* describeParseStatus(ParseStatus status) {
+    switch (status) {
+        case ParseStatus::Ok: return "ok";
+        case ParseStatus::MissingField: return "missing username, date or time";
+        case ParseStatus::InvalidTimestamp: return "invalid date/time format";
+    }
+    return "unknown error";
+}
+
+// Разбирает строку "username YYYY-MM-DD HH:MM:SS.mmm: content" без копирования.
+// Ошибка возвращается кодом: на грязных журналах исключение на каждую
+// плохую строку обходится слишком дорого.
+ParseStatus tryParseMessageFields(std::string_view line, MessageFields& fields) {
+    std::string_view tokens[3]; // имя, дата, время
+    std::size_t pos = 0;
+    for (auto& token : tokens) {
+        while (pos < line.size() && isSpace(line[pos])) ++pos;
+        std::size_t start = pos;
+        while (pos < line.size() && !isSpace(line[pos])) ++pos;
+        if (start == pos) {
+            return ParseStatus::MissingField;
+        }
+        token = line.substr(start, pos - start);
+    }
+
+    if (!parseTimestamp(tokens[1], tokens[2], fields.time)) {
+        return ParseStatus::InvalidTimestamp;
+    }
+
+    // Текст начинается после одного разделителя за временем
+    fields.username = tokens[0];
+    fields.content = pos < line.size() ? line.substr(pos + 1) : std::string_view();
+    return ParseStatus::Ok;
+}
+
+[[noreturn]] void throwParseError(std::string_view line, ParseStatus status) {
+    if (status == ParseStatus::InvalidTimestamp) {
+        throw std::invalid_argument("Invalid date/time format.");
+    }
+    throw std::invalid_argument("Failed to parse message line: " + std::string(line));
+}
+
+MessageFields parseMessageFields(std::string_view line) {
+    MessageFields fields;
+    ParseStatus status = tryParseMessageFields(line, fields);
+    if (status != ParseStatus::Ok) {
+        throwParseError(line, status);
+    }
+    return fields;
+}
+
+// Строка, пропущенная при мягкой загрузке
+struct LoadError {
+    std::string filename;
+    std::size_t lineNumber; // с 1
+    ParseStatus status;
+
+    void print(std::ostream& out) const {
+        out << filename << ":" << lineNumber << ": " << describeParseStatus(status) << "\n";
+    }
+};
+
+// Отчёт мягкой загрузки: некорректные строки не прерывают загрузку,
+// а записываются сюда
+struct LoadReport {
+    std::size_t loadedCount = 0;
+    std::size_t duplicateCount = 0; // отброшено как копии (см. MessageDatabase::setDeduplication)
+    std::vector<LoadError> errors;
+
+    void print(std::ostream& out) const {
+        for (const auto& error : errors) {
+            error.print(out);
+        }
+        out << "Loaded " << loadedCount << " messages, skipped " << errors.size() << " malformed lines";
+        if (duplicateCount > 0) {
+            out << ", dropped " << duplicateCount << " duplicates";
+        }
+        out << "\n";
+    }
+
+    // Учитывает добавление: added - добавлено в базу, parsed - разобрано
+    void countAdded(std::size_t parsed, std::size_t added) {
+        loadedCount += added;
+        duplicateCount += parsed - added;
+    }
+};
+
+// Поля сообщения указывают внутрь line
+std::optional<Message> parseMessageLine(const std::string& line) {
+    MessageFields fields = parseMessageFields(line);
+    return Message(fields.username, fields.time, fields.content);
+}
+
+// Если передан report, некорректные строки пропускаются и записываются
+// в него, иначе первая такая строка прерывает загрузку исключением
+void loadMessagesFromFile(const std::string& filename, MessageDatabase& db, LoadReport* report = nullptr) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open file: " + filename);
+    }
+
+    std::string line;
+    std::size_t lineNumber = 0;
+    while (std::getline(file, line))
+    {
+        ++lineNumber;
+        MessageFields fields;
+        ParseStatus status = tryParseMessageFields(line, fields);
+        if (status != ParseStatus::Ok) {
+            if (!report) {
+                throwParseError(line, status);
+            }
+            report->errors.push_back({filename, lineNumber, status});
+            continue;
+        }
+
+        bool added = db.addMessage(Message(fields.username, fields.time, fields.content));
+        if (report) {
+            report->countAdded(1, added);
+        }
+    }
+    db.publish();
+}
+
+// Маски пробельных символов (как isSpace) и переводов строки в 64 байтах
+// с позиции p: бит i соответствует байту p[i]
+inline void scanWindow(const char* p, std::uint64_t& spaces, std::uint64_t& newlines) {
+    spaces = 0;
+    newlines = 0;
+#if defined(__AVX2__)
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i four = _mm256_set1_epi8(4);
+    for (int i = 0; i < 2; ++i) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32 * i));
+        // '\t'..'\r': v - '\t' без знака не больше 4
+        __m256i control = _mm256_cmpeq_epi8(_mm256_subs_epu8(_mm256_sub_epi8(v, tab), four), _mm256_setzero_si256());
+        __m256i isSpace = _mm256_or_si256(_mm256_cmpeq_epi8(v, space), control);
+        spaces |= std::uint64_t(std::uint32_t(_mm256_movemask_epi8(isSpace))) << (32 * i);
+        newlines |= std::uint64_t(std::uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline)))) << (32 * i);
+    }
+#elif defined(__SSE2__)
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i four = _mm_set1_epi8(4);
+    for (int i = 0; i < 4; ++i) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * i));
+        __m128i control = _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(v, tab), four), _mm_setzero_si128());
+        __m128i isSpace = _mm_or_si128(_mm_cmpeq_epi8(v, space), control);
+        spaces |= std::uint64_t(std::uint32_t(_mm_movemask_epi8(isSpace))) << (16 * i);
+        newlines |= std::uint64_t(std::uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)))) << (16 * i);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    // В NEON нет movemask: байты сравнения складываются с весами 1, 2, 4, ... 128
+    static const std::uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    const uint8x16_t weight = vld1q_u8(weights);
+    auto toMask = [&](uint8x16_t matches) {
+        uint8x16_t bits = vandq_u8(matches, weight);
+        return std::uint64_t(vaddv_u8(vget_low_u8(bits))) | std::uint64_t(vaddv_u8(vget_high_u8(bits))) << 8;
+    };
+    for (int i = 0; i < 4; ++i) {
+        uint8x16_t v = vld1q_u8(reinterpret_cast<const std::uint8_t*>(p + 16 * i));
+        uint8x16_t control = vcleq_u8(vsubq_u8(v, vdupq_n_u8('\t')), vdupq_n_u8(4));
+        uint8x16_t isSpace = vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')), control);
+        spaces |= toMask(isSpace) << (16 * i);
+        newlines |= toMask(vceqq_u8(v, vdupq_n_u8('\n'))) << (16 * i);
+    }
+#else
+    for (int i = 0; i < 64; ++i) {
+        spaces |= std::uint64_t(isSpace(p[i])) << i;
+        newlines |= std::uint64_t(p[i] == '\n') << i;
+    }
+#endif
+}
+
+// Быстрый разбор строки, которая начинается в p (до конца буфера end не меньше
+// 64 байт): имя, дата и время ищутся по маскам одного окна в 64 байта.
+// Возвращает false, если строку нужно разобрать обычным путём: заголовок
+// не уместился в окно или строка некорректна (тогда parseMessageFields
+// сообщит об ошибке).
+inline bool scanMessageLine(const char* p, const char* end, std::size_t& lineSize, MessageFields& fields) {
+    std::uint64_t spaces, newlines;
+    scanWindow(p, spaces, newlines);
+
+    std::size_t lineEnd = 64;
+    if (newlines != 0) {
+        lineEnd = static_cast<std::size_t>(__builtin_ctzll(newlines));
+        spaces |= ~0ULL << lineEnd; // за концом строки токены не продолжаются
+    }
+
+    std::string_view tokens[3]; // имя, дата, время
+    std::size_t pos = 0;
+    for (auto& token : tokens) {
+        std::uint64_t rest = ~spaces & (~0ULL << pos);
+        if (rest == 0) {
+            return false;
+        }
+        std::size_t start = static_cast<std::size_t>(__builtin_ctzll(rest));
+        std::uint64_t after = spaces & (~0ULL << start);
+        if (after == 0) {
+            return false;
+        }
+        pos = static_cast<std::size_t>(__builtin_ctzll(after));
+        token = std::string_view(p + start, pos - start);
+    }
+
+    if (!parseTimestamp(tokens[1], tokens[2], fields.time)) {
+        return false;
+    }
+
+    if (newlines == 0) {
+        const void* newline = std::memchr(p + 64, '\n', static_cast<std::size_t>(end - p - 64));
+        lineEnd = newline ? static_cast<std::size_t>(static_cast<const char*>(newline) - p) : static_cast<std::size_t>(end - p);
+    }
+
+    // Текст начинается после одного разделителя за временем
+    fields.username = tokens[0];
+    fields.content = pos < lineEnd ? std::string_view(p + pos + 1, lineEnd - pos - 1) : std::string_view();
+    lineSize = lineEnd;
+    return true;
+}
+
+// Разбирает все строки буфера и передаёт callback поля каждого сообщения,
+// а onError(номер строки с 1, строка, status) - некорректные строки.
+// Пока до конца буфера есть 64 байта, строки разбираются по маскам,
+// остальные и нестандартные - через tryParseMessageFields.
+// Возвращает число строк.
+template<class Callback, class ErrorHandler>
+std::size_t forEachMessageLine(std::string_view data, Callback&& callback, ErrorHandler&& onError) {
+    const char* end = data.data() + data.size();
+    std::size_t pos = 0;
+    std::size_t lineCount = 0;
+    while (pos < data.size()) {
+        ++lineCount;
+        MessageFields fields;
+        std::size_t lineSize;
+        if (data.size() - pos >= 64 && scanMessageLine(data.data() + pos, end, lineSize, fields)) {
+            callback(fields);
+        } else {
+            std::size_t lineEnd = data.find('\n', pos);
+            if (lineEnd == std::string_view::npos) {
+                lineEnd = data.size();
+            }
+            lineSize = lineEnd - pos;
+            std::string_view line = data.substr(pos, lineSize);
+            ParseStatus status = tryParseMessageFields(line, fields);
+            if (status == ParseStatus::Ok) {
+                callback(fields);
+            } else {
+                onError(lineCount, line, status);
+            }
+        }
+        pos += lineSize + 1;
+    }
+    return lineCount;
+}
+
+// Строгий вариант: первая некорректная строка прерывает разбор исключением
+template<class Callback>
+std::size_t forEachMessageLine(std::string_view data, Callback&& callback) {
+    return forEachMessageLine(data, std::forward<Callback>(callback),
+                              [](std::size_t, std::string_view line, ParseStatus status) {
+                                  throwParseError(line, status);
+                              });
+}
+
+// Загрузка без копирования текста: файл отображается в память, и сообщения
+// ссылаются на текст прямо внутри отображения. Отображение освобождается
+// вместе с последним сегментом, который на него ссылается.
+// Некорректные строки - как в loadMessagesFromFile.
+void loadMessagesFromMappedFile(const std::string& filename, MessageDatabase& db, LoadReport* report = nullptr) {
+    auto file = std::make_shared<const MappedFile>(filename);
+
+    auto add = [&](const MessageFields& fields) {
+        return db.addMessage(Message(fields.username, fields.time, fields.content), file);
+    };
+    if (report) {
+        forEachMessageLine(file->view(), [&](const MessageFields& fields) {
+            report->countAdded(1, add(fields));
+        }, [&](std::size_t lineNumber, std::string_view, ParseStatus status) {
+            report->errors.push_back({filename, lineNumber, status});
+        });
+    } else {
+        forEachMessageLine(file->view(), add);
+    }
+    db.publish();
+}
+
+// Сортирует по времени почти упорядоченный пакет с сохранением порядка
+// равных. Сообщения, которые раньше уже встреченного максимума, выносятся
+// отдельно, сортируются и вливаются обратно, поэтому упорядоченный пакет
+// обходится одним проходом, а почти упорядоченный - сортировкой немногих.
+void sortMostlySorted(std::vector<Message>& batch) {
+    auto earlier = [](const Message& a, const Message& b) {
+        return a.time < b.time;
+    };
+    if (std::is_sorted(batch.begin(), batch.end(), earlier)) {
+        return;
+    }
+
+    std::vector<Message> ordered, late;
+    ordered.reserve(batch.size());
+    for (const auto& message : batch) {
+        if (ordered.empty() || message.time >= ordered.back().time) {
+            ordered.push_back(message);
+        } else {
+            late.push_back(message);
+        }
+    }
+    std::stable_sort(late.begin(), late.end(), earlier);
+
+    // При равном времени std::merge берёт из первой последовательности,
+    // а сообщение из ordered с тем же временем в файле стоит раньше
+    batch.clear();
+    std::merge(ordered.begin(), ordered.end(), late.begin(), late.end(), std::back_inserter(batch), earlier);
+}
+
+// Сливает отсортированные по времени пакеты в один. При равном времени раньше
+// идёт пакет с меньшим номером, поэтому порядок совпадает с порядком в исходных файлах.
+std::vector<Message> mergeSortedBatches(std::vector<std::vector<Message>>& batches) {
+    std::size_t total = 0;
+    for (const auto& batch : batches) {
+        total += batch.size();
+    }
+
+    // Элемент кучи: номер пакета и позиция в нём
+    using Cursor = std::pair<std::size_t, std::size_t>;
+    auto later = [&](const Cursor& a, const Cursor& b) {
+        std::int64_t timeA = batches[a.first][a.second].time;
+        std::int64_t timeB = batches[b.first][b.second].time;
+        return timeA != timeB ? timeA > timeB : a.first > b.first;
+    };
+    std::priority_queue<Cursor, std::vector<Cursor>, decltype(later)> heap(later);
+    for (std::size_t i = 0; i < batches.size(); ++i) {
+        if (!batches[i].empty()) {
+            heap.emplace(i, 0);
+        }
+    }
+
+    std::vector<Message> merged;
+    merged.reserve(total);
+    while (!heap.empty()) {
+        Cursor cursor = heap.top();
+        heap.pop();
+        merged.push_back(batches[cursor.first][cursor.second]);
+        if (++cursor.second < batches[cursor.first].size()) {
+            heap.push(cursor);
+        }
+    }
+    batches.clear();
+    return merged;
+}
+
+// Параллельная загрузка: отображённый файл делится на куски по границам строк,
+// каждый кусок разбирается своим потоком в отдельный буфер, затем буферы
+// сортируются по времени и за один проход сливаются в базу. Некорректные
+// строки - как в loadMessagesFromFile.
+void loadMessagesFromFileParallel(const std::string& filename, MessageDatabase& db,
+                                  unsigned threadCount = std::thread::hardware_concurrency(),
+                                  LoadReport* report = nullptr) {
+    const std::size_t minChunkSize = 1 << 20; // мелкие куски не окупают запуск потока
+
+    auto file = std::make_shared<const MappedFile>(filename);
+    std::string_view data = file->view();
+
+    std::size_t maxThreads = data.size() / minChunkSize + 1;
+    std::size_t chunkCount = std::max<std::size_t>(1, std::min<std::size_t>(threadCount, maxThreads));
+
+    // Границы кусков сдвигаются на начало следующей строки
+    std::vector<std::size_t> bounds{0};
+    for (std::size_t i = 1; i < chunkCount; ++i) {
+        std::size_t pos = std::max(bounds.back(), data.size() / chunkCount * i);
+        pos = data.find('\n', pos);
+        if (pos == std::string_view::npos) {
+            break;
+        }
+        if (pos + 1 > bounds.back()) {
+            bounds.push_back(pos + 1);
+        }
+    }
+    bounds.push_back(data.size());
+    chunkCount = bounds.size() - 1;
+
+    std::vector<std::vector<Message>> batches(chunkCount);
+    std::vector<std::exception_ptr> errors(chunkCount);
+    // Номера некорректных строк внутри куска и число строк куска
+    std::vector<std::vector<LoadError>> skipped(chunkCount);
+    std::vector<std::size_t> lineCounts(chunkCount);
+    auto worker = [&](std::size_t chunk) {
+        try {
+            std::vector<Message>& batch = batches[chunk];
+            std::string_view chunkData = data.substr(bounds[chunk], bounds[chunk + 1] - bounds[chunk]);
+            auto add = [&](const MessageFields& fields) {
+                batch.emplace_back(fields.username, fields.time, fields.content);
+            };
+            if (report) {
+                lineCounts[chunk] = forEachMessageLine(chunkData, add, [&](std::size_t lineNumber, std::string_view, ParseStatus status) {
+                    skipped[chunk].push_back({filename, lineNumber, status});
+                });
+            } else {
+                forEachMessageLine(chunkData, add);
+            }
+            sortMostlySorted(batch);
+        } catch (...) {
+            errors[chunk] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (std::size_t chunk = 1; chunk < chunkCount; ++chunk) {
+        workers.emplace_back(worker, chunk);
+    }
+    worker(0);
+    for (auto& thread : workers) {
+        thread.join();
+    }
+
+    // Ошибка из самого раннего куска - та же, что дала бы последовательная загрузка
+    for (const auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    if (report) {
+        std::size_t firstLine = 0;
+        for (std::size_t chunk = 0; chunk < chunkCount; ++chunk) {
+            for (auto& error : skipped[chunk]) {
+                error.lineNumber += firstLine;
+                report->errors.push_back(std::move(error));
+            }
+            firstLine += lineCounts[chunk];
+        }
+    }
+
+    std::vector<Message> merged = mergeSortedBatches(batches);
+    std::size_t added = db.addSortedMessages(merged, file);
+    if (report) {
+        report->countAdded(merged.size(), added);
+    }
+}
+
+// Пакет запросов, которые выполняются за один проход по сообщениям.
+// Строка запроса:
+//   user <имя> [<начало> <конец>] [> <файл>]
+//   range <начало> <конец> [> <файл>]
+// Время записывается как "YYYY-MM-DD HH:MM:SS.mmm". Пустые строки и строки,
+// начинающиеся с '#', пропускаются. Результаты запросов без файла выводятся
+// в stdout после прохода в порядке запросов, запросы с одним файлом пишут в него вместе.
+class QueryBatch {
+public:
+    static QueryBatch parse(std::istream& in) {
+        QueryBatch batch;
+        std::string line;
+        std::size_t lineNumber = 0;
+        while (std::getline(in, line)) {
+            ++lineNumber;
+            batch.add(line, lineNumber);
+        }
+        return batch;
+    }
+
+    void add(const std::string& line, std::size_t lineNumber = 0) {
+        std::vector<std::string_view> tokens;
+        std::string_view rest(line);
+        while (true) {
+            std::size_t start = rest.find_first_not_of(" \t\r");
+            if (start == std::string_view::npos) break;
+            std::size_t end = std::min(rest.find_first_of(" \t\r", start), rest.size());
+            tokens.push_back(rest.substr(start, end - start));
+            rest.remove_prefix(end);
+        }
+        if (tokens.empty() || tokens[0][0] == '#') {
+            return;
+        }
+
+        auto fail = [&]() {
+            throw std::invalid_argument("Bad query at line " + std::to_string(lineNumber) + ": " + line);
+        };
+
+        Query query;
+        query.text = line;
+        if (tokens.size() >= 2 && tokens[tokens.size() - 2] == ">") {
+            query.output = tokens.back();
+            tokens.resize(tokens.size() - 2);
+        }
+
+        std::size_t rangeAt = 0;
+        if (tokens[0] == "user" && tokens.size() >= 2) {
+            query.username = std::string(tokens[1]);
+            rangeAt = 2;
+        } else if (tokens[0] == "range") {
+            rangeAt = 1;
+        } else {
+            fail();
+        }
+
+        if (tokens.size() == rangeAt + 4) {
+            if (!parseTimestamp(tokens[rangeAt], tokens[rangeAt + 1], query.startTime) ||
+                !parseTimestamp(tokens[rangeAt + 2], tokens[rangeAt + 3], query.endTime)) {
+                fail();
+            }
+        } else if (tokens.size() != rangeAt || !query.username) {
+            fail();
+        }
+        queries.push_back(std::move(query));
+    }
+
+    std::size_t size() const {
+        return queries.size();
+    }
+
+    // Выполняет все запросы за один проход по объединению их диапазонов.
+    // Строки просматриваются в порядке времени; запрос становится активным,
+    // когда время доходит до его начала, и выбывает после его конца.
+    void run(const DatabaseView& view) {
+        std::unordered_map<std::string, std::unique_ptr<ResultSink>> files;
+        for (auto& query : queries) {
+            query.rows.clear();
+            query.sink = nullptr;
+            if (!query.output.empty()) {
+                auto& sink = files[query.output];
+                if (!sink) {
+                    sink = std::make_unique<ResultSink>(query.output);
+                }
+                query.sink = sink.get();
+            }
+        }
+
+        std::vector<std::size_t> order(queries.size());
+        for (std::size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+            return queries[a].startTime < queries[b].startTime;
+        });
+
+        // Активные запросы: по имени пользователя и без пользователя
+        std::unordered_map<std::string_view, std::vector<std::size_t>> activeByUser;
+        std::vector<std::size_t> activeForAll;
+        std::size_t next = 0;
+
+        auto route = [&](std::vector<std::size_t>& active, MessagePtr message) {
+            for (std::size_t i = 0; i < active.size();) {
+                Query& query = queries[active[i]];
+                if (query.endTime < message->time) {
+                    active[i] = active.back();
+                    active.pop_back();
+                    continue;
+                }
+                if (query.sink) {
+                    query.sink->write(*message);
+                } else {
+                    query.rows.push_back(message);
+                }
+                ++i;
+            }
+        };
+
+        auto visit = [&](MessagePtr message) {
+            while (next < order.size() && queries[order[next]].startTime <= message->time) {
+                Query& query = queries[order[next++]];
+                if (query.username) {
+                    activeByUser[*query.username].push_back(&query - queries.data());
+                } else {
+                    activeForAll.push_back(&query - queries.data());
+                }
+            }
+            route(activeForAll, message);
+            auto it = activeByUser.find(message->username);
+            if (it != activeByUser.end()) {
+                route(it->second, message);
+            }
+        };
+
+        // Промежутки между диапазонами запросов не просматриваются
+        std::size_t i = 0;
+        while (i < order.size()) {
+            std::int64_t start = queries[order[i]].startTime;
+            std::int64_t end = queries[order[i]].endTime;
+            for (++i; i < order.size() && queries[order[i]].startTime <= end; ++i) {
+                end = std::max(end, queries[order[i]].endTime);
+            }
+            view.forEachMessageInTimeRange(start, end, visit);
+        }
+
+        for (auto& [filename, sink] : files) {
+            sink->flush();
+        }
+
+        ResultSink out;
+        for (std::size_t n = 0; n < queries.size(); ++n) {
+            const Query& query = queries[n];
+            if (query.sink) {
+                continue;
+            }
+            out.writeText("Query " + std::to_string(n + 1) + ": " + query.text + "\n");
+            for (MessagePtr message : query.rows) {
+                out.write(*message);
+            }
+            out.writeText("\n");
+        }
+    }
+
+private:
+    struct Query {
+        std::string text;
+        std::optional<std::string> username;
+        std::int64_t startTime = std::numeric_limits<std::int64_t>::min();
+        std::int64_t endTime = std::numeric_limits<std::int64_t>::max();
+        std::string output;
+        // Куда идут строки: файл или, для вывода в stdout, накопленные ссылки
+        ResultSink* sink = nullptr;
+        std::vector<MessagePtr> rows;
+    };
+
+    std::vector<Query> queries;
+};
+
+// Загрузка набора файлов (например, журналов по серверам и дням): файлы
+// разбираются параллельно, каждый упорядочивается по времени и все они
+// сливаются в базу за один проход. При равном времени раньше идут сообщения
+// файла, стоящего в списке раньше. Отображения файлов живут, пока в базе
+// есть сообщения хотя бы из одного из них. Некорректные строки - как
+// в loadMessagesFromFile; файлы, которые не удалось открыть, не пропускаются.
+void loadMessagesFromFiles(const std::vector<std::string>& filenames, MessageDatabase& db,
+                           unsigned threadCount = std::thread::hardware_concurrency(),
+                           LoadReport* report = nullptr) {
+    auto files = std::make_shared<std::vector<std::shared_ptr<const MappedFile>>>(filenames.size());
+    std::vector<std::vector<Message>> batches(filenames.size());
+    std::vector<std::exception_ptr> errors(filenames.size());
+    std::vector<std::vector<LoadError>> skipped(filenames.size());
+    std::atomic<std::size_t> nextFile{0};
+
+    auto worker = [&]() {
+        for (std::size_t i = nextFile++; i < filenames.size(); i = nextFile++) {
+            try {
+                (*files)[i] = std::make_shared<const MappedFile>(filenames[i]);
+                std::vector<Message>& batch = batches[i];
+                auto add = [&](const MessageFields& fields) {
+                    batch.emplace_back(fields.username, fields.time, fields.content);
+                };
+                if (report) {
+                    forEachMessageLine((*files)[i]->view(), add, [&](std::size_t lineNumber, std::string_view, ParseStatus status) {
+                        skipped[i].push_back({filenames[i], lineNumber, status});
+                    });
+                } else {
+                    forEachMessageLine((*files)[i]->view(), add);
+                }
+                sortMostlySorted(batch);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        }
+    };
+
+    std::size_t workerCount = std::max<std::size_t>(1, std::min<std::size_t>(threadCount, filenames.size()));
+    std::vector<std::thread> workers;
+    for (std::size_t i = 1; i < workerCount; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : workers) {
+        thread.join();
+    }
+
+    for (const auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    if (report) {
+        for (std::size_t i = 0; i < filenames.size(); ++i) {
+            std::move(skipped[i].begin(), skipped[i].end(), std::back_inserter(report->errors));
+        }
+    }
+
+    std::vector<Message> merged = mergeSortedBatches(batches);
+    std::size_t added = db.addSortedMessages(merged, files);
+    if (report) {
+        report->countAdded(merged.size(), added);
+    }
+}
+
+// Режим слежения за растущим журналом: запоминает, сколько байт уже разобрано,
+// и при каждом вызове readNew() добавляет в базу только новые полные строки
+// (неполная последняя строка ждёт своего перевода строки). Если файл усекли,
+// он читается заново с начала; если его переименовали и на его месте создан
+// новый (ротация), старый дочитывается до конца и дальше читается новый.
+// Изменения ждёт через inotify на Linux, на остальных системах - опросом.
+class LogFollower {
+public:
+    // Некорректные строки - как в loadMessagesFromFile
+    LogFollower(const std::string& filename, MessageDatabase& db, LoadReport* report = nullptr)
+        : filename(filename), db(db), report(report) {
+        fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open file: " + filename);
+        }
+#ifdef __linux__
+        // Следим за каталогом: так видны и дописывание, и появление нового файла при ротации
+        const std::string directory = directoryOf(filename);
+        watchFd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watchFd >= 0 &&
+            ::inotify_add_watch(watchFd, directory.c_str(), IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO) < 0) {
+            ::close(watchFd);
+            watchFd = -1; // остаётся опрос
+        }
+#endif
+    }
+
+    ~LogFollower() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        if (watchFd >= 0) {
+            ::close(watchFd);
+        }
+    }
+
+    LogFollower(const LogFollower&) = delete;
+    LogFollower& operator=(const LogFollower&) = delete;
+
+    // Сколько байт текущего файла уже прочитано
+    std::uint64_t offset() const {
+        return readOffset;
+    }
+
+    // Дочитывает всё, что появилось с прошлого вызова, и публикует добавленное.
+    // Возвращает число добавленных сообщений.
+    std::size_t readNew() {
+        struct stat current;
+        if (::fstat(fd, &current) != 0) {
+            throw std::runtime_error("Could not stat file: " + filename);
+        }
+        if (static_cast<std::uint64_t>(current.st_size) < readOffset) {
+            // Файл усекли: всё, что в нём теперь есть, - новые строки
+            readOffset = 0;
+            lineNumber = 0;
+            pending.clear();
+        }
+
+        std::size_t added = readToEnd();
+
+        struct stat onDisk;
+        if (::stat(filename.c_str(), &onDisk) == 0 && (onDisk.st_ino != current.st_ino || onDisk.st_dev != current.st_dev)) {
+            int rotated = ::open(filename.c_str(), O_RDONLY);
+            if (rotated >= 0) {
+                // Старый файл дописан до конца, его последняя строка уже не продолжится
+                added += readToEnd();
+                if (!pending.empty()) {
+                    pending.push_back('\n');
+                    added += addLines(pending.size());
+                }
+                ::close(fd);
+                fd = rotated;
+                readOffset = 0;
+                lineNumber = 0;
+                added += readToEnd();
+            }
+        }
+
+        if (added > 0) {
+            db.publish();
+        }
+        return added;
+    }
+
+    // Ждёт изменений не дольше timeoutMilliseconds и дочитывает их
+    std::size_t waitAndReadNew(int timeoutMilliseconds) {
+#ifdef __linux__
+        if (watchFd >= 0) {
+            pollfd request{watchFd, POLLIN, 0};
+            if (::poll(&request, 1, timeoutMilliseconds) > 0) {
+                char events[4096];
+                while (::read(watchFd, events, sizeof(events)) > 0) {
+                }
+            }
+            return readNew();
+        }
+#endif
+        std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMilliseconds));
+        return readNew();
+    }
+
+private:
+    // Читает текущий файл до конца кусками и добавляет полные строки
+    std::size_t readToEnd() {
+        const std::size_t chunkSize = 1 << 20;
+        std::size_t added = 0;
+        while (true) {
+            std::size_t oldSize = pending.size();
+            pending.resize(oldSize + chunkSize);
+            ssize_t result = ::pread(fd, &pending[oldSize], chunkSize, static_cast<off_t>(readOffset));
+            if (result < 0) {
+                pending.resize(oldSize);
+                if (errno == EINTR) continue;
+                throw std::runtime_error("Could not read file: " + filename);
+            }
+            pending.resize(oldSize + static_cast<std::size_t>(result));
+            if (result == 0) {
+                return added;
+            }
+            readOffset += static_cast<std::uint64_t>(result);
+
+            std::size_t lastNewline = pending.rfind('\n');
+            if (lastNewline != std::string::npos) {
+                added += addLines(lastNewline + 1);
+            }
+        }
+    }
+
+    // Разбирает первые size байт буфера (целые строки) и удаляет их из буфера.
+    // В строгом режиме при ошибке в базу не попадает ничего из этих строк.
+    std::size_t addLines(std::size_t size) {
+        std::string_view data(pending.data(), size);
+        std::vector<Message> batch;
+        auto add = [&](const MessageFields& fields) {
+            batch.emplace_back(fields.username, fields.time, fields.content);
+        };
+        std::size_t lineCount;
+        if (report) {
+            lineCount = forEachMessageLine(data, add, [&](std::size_t line, std::string_view, ParseStatus status) {
+                report->errors.push_back({filename, lineNumber + line, status});
+            });
+        } else {
+            lineCount = forEachMessageLine(data, add);
+        }
+
+        // Буфер переиспользуется, поэтому текст копируется в базу
+        std::size_t added = 0;
+        for (const auto& message : batch) {
+            added += db.addMessage(message);
+        }
+        if (report) {
+            report->countAdded(batch.size(), added);
+        }
+        lineNumber += lineCount;
+        pending.erase(0, size);
+        return added;
+    }
+
+    std::string filename;
+    MessageDatabase& db;
+    LoadReport* report;
+    int fd = -1;
+    int watchFd = -1;
+    std::uint64_t readOffset = 0;
+    std::size_t lineNumber = 0; // строк текущего файла уже разобрано
+    std::string pending;        // прочитанные байты, которые ещё не разобраны
+};
+
+std::int64_t timestampFromString(const std::string& dateTime) {
+    std::int64_t timestamp;
+    if (!parseTimestamp(dateTime, timestamp)) {
+        throw std::invalid_argument("Invalid date/time: " + dateTime);
+    }
+    return timestamp;
+}
+
+#ifndef MESSAGE_DATABASE_NO_MAIN
+int main(int argc, char* argv[]) {
+    try {
+        // new [--lenient] [--dedup] [--compress] [--follow | --batch <файл запросов или "-" для stdin>]
+        // --lenient: некорректные строки dialogs.txt пропускаются, отчёт - в stderr
+        // --dedup: повторы уже загруженных сообщений отбрасываются
+        // --compress: тексты запечатанных сегментов хранятся сжатыми
+        // --follow: dialogs.txt дочитывается по мере записи, пока процесс не остановят
+        bool lenient = false;
+        bool dedup = false;
+        bool compress = false;
+        bool follow = false;
+        std::optional<std::string> queriesFile;
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            if (arg == "--lenient") {
+                lenient = true;
+            } else if (arg == "--dedup") {
+                dedup = true;
+            } else if (arg == "--compress") {
+                compress = true;
+            } else if (arg == "--follow") {
+                follow = true;
+            } else if (arg == "--batch" && i + 1 < argc) {
+                queriesFile = argv[++i];
+            } else {
+                throw std::invalid_argument("Unknown argument: " + arg);
+            }
+        }
+
+        MessageDatabase db;
+        db.setDeduplication(dedup);
+        db.setContentCompression(compress);
+
+        if (follow) {
+            LoadReport report;
+            LogFollower follower("dialogs.txt", db, lenient ? &report : nullptr);
+            std::size_t total = follower.readNew();
+            std::size_t reportedErrors = 0;
+            std::cerr << "Loaded " << total << " messages, following dialogs.txt\n";
+            while (true) {
+                std::size_t added = follower.waitAndReadNew(1000);
+                for (; reportedErrors < report.errors.size(); ++reportedErrors) {
+                    report.errors[reportedErrors].print(std::cerr);
+                }
+                if (added > 0) {
+                    total += added;
+                    std::cerr << "Added " << added << " messages, " << total << " in total\n";
+                }
+            }
+        }
+
+        if (lenient) {
+            LoadReport report;
+            loadMessagesFromFile("dialogs.txt", db, &report);
+            if (!report.errors.empty()) {
+                report.print(std::cerr);
+            }
+        } else {
+            loadMessagesFromFile("dialogs.txt", db);
+        }
+
+        // Пакетный режим
+        if (queriesFile) {
+            const std::string& queriesFilename = *queriesFile;
+            QueryBatch batch;
+            if (queriesFilename == "-") {
+                batch = QueryBatch::parse(std::cin);
+            } else {
+                std::ifstream in(queriesFilename);
+                if (!in.is_open()) {
+                    throw std::runtime_error("Could not open file: " + queriesFilename);
+                }
+                batch = QueryBatch::parse(in);
+            }
+            batch.run(*db.view());
+            return 0;
+        }
 
-        loadMessagesFromFile("dialogs.txt", db);
+        const std::int64_t rangeStart = timestampFromString("2023-10-07 10:00:00.000");
+        const std::int64_t rangeEnd = timestampFromString("2023-10-07 12:00:00.000");
 
         std::cout << "All messages from user Alice:\n";
         db.printAllMessagesFromUser("Alice");
 
         std::cout << "\nMessages from user Bob between 2023-10-07 10:00:00.000 and 2023-10-07 12:00:00.000:\n";
-        db.printMessagesFromUserInTimeRange("Bob", "2023-10-07 10:00:00.000", "2023-10-07 12:00:00.000");
+        db.printMessagesFromUserInTimeRange("Bob", rangeStart, rangeEnd);
 
         std::cout << "\nAll messages between 2023-10-07 10:00:00.000 and 2023-10-07 12:00:00.000:\n";
-        db.printMessagesInTimeRange("2023-10-07 10:00:00.000", "2023-10-07 12:00:00.000");
+        db.printMessagesInTimeRange(rangeStart, rangeEnd);
 
         std::cout << "\nRemoving a specific message from Alice:\n";
-        auto msgOpt = db.findMessage("Alice", "2023-10-07 11:00:00.000:", "Hello Bob!");
+        auto msgOpt = db.findMessage("Alice", timestampFromString("2023-10-07 11:00:00.000"), "Hello Bob!");
         if (msgOpt) {
             db.removeMessage(*msgOpt);
         } else {
@@ -185,13 +5163,13 @@ int main() {
         }
 
         std::cout << "\nAll messages after removing a specific message:\n";
-        db.printMessagesInTimeRange("2023-10-07 10:00:00.000", "2023-10-07 12:00:00.000");
+        db.printMessagesInTimeRange(rangeStart, rangeEnd);
 
         std::cout << "\nRemoving all messages from Alice:\n";
         db.removeAllMessagesFromUser("Alice");
 
         std::cout << "\nAll messages after removing all messages from Alice:\n";
-        db.printMessagesInTimeRange("2023-10-07 10:00:00.000", "2023-10-07 12:00:00.000");
+        db.printMessagesInTimeRange(rangeStart, rangeEnd);
 
     } catch (const std::invalid_argument& ia) {
         // Обработка исключений, связанных с недопустимым аргументом
@@ -212,6 +5190,7 @@ int main() {
     }
     return 0;
 }
+#endif
 
 
 
@@ -0,0 +1,181 @@
+// Проверки базы сообщений: main.cpp собирается вместе с ними, но без своего main()
+#define MESSAGE_DATABASE_NO_MAIN
+#include "main.cpp"
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const std::string& what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << "\n";
+        ++failures;
+    }
+}
+
+// Обмен сообщениями через полночь попадает в соседние сегменты-сутки
+void testConversationAcrossSegments() {
+    const std::int64_t gap = 5 * millisecondsPerMinute;
+    const std::int64_t aliceTime = timestampFromString("2023-10-07 23:59:00.000");
+    const std::int64_t bobTime = timestampFromString("2023-10-08 00:01:00.000");
+
+    MessageDatabase db(millisecondsPerDay, 0, gap);
+    db.addMessage(Message("Alice", aliceTime, "Still awake?"));
+    db.addMessage(Message("Bob", bobTime, "Yes, reading."));
+    check(db.segmentCount() == 2, "messages around midnight go to two segments");
+    check(db.conversationsBetween("Alice", "Bob").size() == 1, "conversation across segments");
+    check(db.conversationsBetween("Alice", "Bob", aliceTime, aliceTime).size() == 1,
+          "conversation across segments, range inside the earlier segment");
+    check(db.conversationsBetween("Alice", "Bob", bobTime, bobTime).size() == 1,
+          "conversation across segments, range inside the later segment");
+    check(db.conversationsOfUser("Bob").size() == 1, "conversation across segments by user");
+
+    // Позднее сообщение добавлено раньше раннего
+    MessageDatabase reversed(millisecondsPerDay, 0, gap);
+    reversed.addMessage(Message("Bob", bobTime, "Yes, reading."));
+    reversed.addMessage(Message("Alice", aliceTime, "Still awake?"));
+    check(reversed.conversationsBetween("Alice", "Bob").size() == 1, "conversation across segments, reversed order");
+
+    // Тот же обмен внутри одних суток
+    MessageDatabase sameDay(millisecondsPerDay, 0, gap);
+    sameDay.addMessage(Message("Alice", aliceTime - millisecondsPerHour, "Still awake?"));
+    sameDay.addMessage(Message("Bob", bobTime - millisecondsPerHour, "Yes, reading."));
+    check(sameDay.conversationsBetween("Alice", "Bob").size() == 1, "conversation inside one segment");
+
+    // Пауза длиннее gap беседу не образует
+    MessageDatabase apart(millisecondsPerDay, 0, gap);
+    apart.addMessage(Message("Alice", aliceTime - gap, "Still awake?"));
+    apart.addMessage(Message("Bob", bobTime, "Yes, reading."));
+    check(apart.conversationsBetween("Alice", "Bob").empty(), "no conversation across a long pause");
+}
+
+// Отсортированный пакет раньше уже загруженных сообщений связывает беседы
+// так же, как добавление по одному
+void testSortedBatchBeforeExisting() {
+    const std::int64_t gap = 5 * millisecondsPerMinute;
+    MessageDatabase db(millisecondsPerDay, 0, gap);
+    db.addMessage(Message("Alice", 10 * millisecondsPerMinute, "Later"));
+    db.addSortedMessages({Message("Bob", 1 * millisecondsPerMinute, "Hi"),
+                          Message("Alice", 2 * millisecondsPerMinute, "Hello")});
+    check(db.conversationsBetween("Alice", "Bob").size() == 1, "sorted batch before existing messages");
+}
+
+// Сегменты ограничены по числу сообщений и при вставках не по порядку времени
+void testBoundedSegments() {
+    const std::size_t capacity = 4;
+    MessageDatabase db(millisecondsPerDay, 0, 0, capacity);
+    for (int i = 0; i < 40; ++i) {
+        db.addMessage(Message("user" + std::to_string(i % 3), (i * 37) % 40 * millisecondsPerMinute, "text"));
+    }
+    db.publish();
+
+    std::int64_t previous = std::numeric_limits<std::int64_t>::min();
+    std::size_t count = 0;
+    db.view()->forEachMessageInTimeRange(0, millisecondsPerDay, [&](MessagePtr message) {
+        check(message->time >= previous, "messages in time order across segments");
+        previous = message->time;
+        ++count;
+    });
+    check(count == 40, "all messages visible after splits");
+    check(db.segmentCount() >= 40 / (2 * capacity), "segments split by capacity");
+    check(db.countMessages({std::string("user1"), 0, millisecondsPerDay}) == 13, "count by user across segments");
+    check(db.findMessage("user2", 37 * 2 % 40 * millisecondsPerMinute, "text") != nullptr, "find in split segment");
+}
+
+// Дописывание с публикацией после каждого сообщения: хвостовые сегменты
+// снова собираются в сегменты около capacity
+void testPublishedTailSegments() {
+    const std::size_t capacity = 64;
+    const std::int64_t gap = 5 * millisecondsPerMinute;
+    MessageDatabase db(millisecondsPerDay, 0, gap, capacity);
+    for (int i = 0; i < 1000; ++i) {
+        db.addMessage(Message(i % 2 ? "Alice" : "Bob", i * millisecondsPerMinute, "tail"));
+        db.publish();
+    }
+
+    check(db.segmentCount() <= 2 * (1000 / capacity) + 2, "tail segments merged");
+    check(db.view()->countMessages({}) == 1000, "all tail messages visible");
+    check(db.view()->searchMessages({"tail"}, TermMatch::All).size() == 1000, "tail messages searchable");
+    check(db.conversationsBetween("Alice", "Bob").size() == 1, "one conversation across tail segments");
+}
+
+// Сжатые тексты читаются и после вытеснения своего блока из кэша
+void testCompressedContent() {
+    MessageDatabase db(millisecondsPerDay, 0, 0, 64);
+    db.setContentCompression(true, 1);
+    for (int i = 0; i < 1000; ++i) {
+        db.addMessage(Message("user" + std::to_string(i % 7), i * millisecondsPerMinute, "message " + std::to_string(i)));
+    }
+    db.publish();
+
+    std::vector<MessagePtr> found = db.view()->searchMessages({"message"}, TermMatch::All);
+    check(found.size() == 1000, "compressed messages searchable");
+    bool intact = true;
+    for (std::size_t i = 0; i < found.size(); ++i) {
+        intact = intact && found[i]->content == "message " + std::to_string(i);
+    }
+    check(intact, "compressed content intact after eviction");
+    check(db.findMessage("user3", 500 * millisecondsPerMinute, "message 500") != nullptr, "find compressed message");
+}
+
+
+// Снимок сохраняет сегменты с индексами, в том числе последний, ещё не запечатанный
+void testSnapshotRoundTrip() {
+    const std::int64_t gap = 5 * millisecondsPerMinute;
+    const std::string filename = "tests_snapshot.tmp";
+    {
+        MessageDatabase db(millisecondsPerDay, 0, gap, 64);
+        for (int i = 0; i < 500; ++i) {
+            db.addMessage(Message(i % 2 ? "Alice" : "Bob", i * millisecondsPerMinute, "note " + std::to_string(i)));
+        }
+        db.saveSnapshot(filename);
+    }
+
+    MessageDatabase loaded(millisecondsPerDay, 0, gap, 64);
+    loaded.loadSnapshot(filename);
+    check(loaded.countMessages({}) == 500, "all messages loaded from snapshot");
+    check(loaded.countMessages({std::string("Alice"), 0, millisecondsPerDay}) == 250, "user index loaded from snapshot");
+    check(loaded.view()->searchMessages({"note"}, TermMatch::All).size() == 500, "text index loaded from snapshot");
+    check(loaded.findMessage("Bob", 42 * millisecondsPerMinute, "note 42") != nullptr, "key index loaded from snapshot");
+    check(loaded.conversationsBetween("Alice", "Bob").size() == 1, "conversation index loaded from snapshot");
+
+    MessageDatabase otherGap(millisecondsPerDay, 0, 2 * gap, 64);
+    bool rejected = false;
+    try {
+        otherGap.loadSnapshot(filename);
+    } catch (const std::runtime_error&) {
+        rejected = true;
+    }
+    check(rejected, "snapshot with another conversation gap rejected");
+    std::remove(filename.c_str());
+}
+
+// Хэши ключей хранятся в снимке, поэтому они не зависят от стандартной библиотеки
+void testStableKeyHash() {
+    check(fnv1a64("a") == 0xaf63dc4c8601ec8cULL, "FNV-1a test vector");
+    check(messageKeyHash("Alice", 1000, "Hello") == 0x532431f33fe56f3fULL, "message key hash is fixed");
+}
+
+}
+
+int main() {
+    try {
+        testConversationAcrossSegments();
+        testSortedBatchBeforeExisting();
+        testBoundedSegments();
+        testPublishedTailSegments();
+        testCompressedContent();
+        testSnapshotRoundTrip();
+        testStableKeyHash();
+    } catch (const std::exception& ex) {
+        std::cerr << "Error: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All checks passed" << std::endl;
+    return 0;
+}